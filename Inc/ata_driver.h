@@ -1,4 +1,130 @@
+#include <stdbool.h>
 #include <stdint.h>
+
+// returned instead of a packed status/error when the drive stays busy for too long.
+#define ATA_ERR_TIMEOUT 0xFFFE
+// returned when a transfer would run past the end of the card.
+#define ATA_ERR_RANGE 0xFFFD
+// returned when the drive is still working on an asynchronous request.
+#define ATA_ERR_BUSY 0xFFFC
+// returned when there is no card in the slot.
+#define ATA_ERR_NO_MEDIA 0xFFFB
+// returned when the card doesn't have the feature asked for.
+#define ATA_ERR_UNSUPPORTED 0xFFFA
+// true when a result is an error the drive reported, rather than one of the codes above.
+#define ATA_ERR_FROM_DRIVE(ERR) (((ERR) & 0x01) && (ERR) < ATA_ERR_UNSUPPORTED)
+
+// No sector set aside for calibration, see ata_set_scratch_sector.
+#define ATA_NO_SCRATCH 0xFFFFFFFF
+
+// Attaches the card if there is one already, an empty slot is left to ata_hotplug_service.
 void ata_init(void);
-uint16_t ata_read_disk(uint16_t address, uint8_t *data, int count);
-uint16_t ata_write_disk(uint16_t address, uint8_t *data, int count);
+
+typedef void (*AtaAttachCallback)(uint32_t disk_len_lba, void *ctx);
+
+/**
+ * Sets a sector aside for bus timing calibration to write its test patterns to, and put back after.
+ * Call it from the attach callback, and only for a sector the card's format reserves, calibration
+ * runs once the callback returns. Without one calibration only reads, comparing LBA 0 at each
+ * timing against what it read at the safe one.
+ */
+void ata_set_scratch_sector(uint32_t lba);
+typedef void (*AtaDetachCallback)(void *ctx);
+
+void ata_set_hotplug_callbacks(AtaAttachCallback attach, AtaDetachCallback detach, void *ctx);
+// Polls an idle bus for cards coming and going. Attaching a card blocks until it is set up.
+void ata_hotplug_service(void);
+bool ata_present(void);
+// Drive write cache control, both refuse with ATA_ERR_BUSY while an asynchronous request is in flight.
+uint16_t ata_set_write_cache(bool enabled);
+// Barrier, returns once every completed write is on the media. Free without a write cache.
+uint16_t ata_flush_cache(void);
+
+// What the attached card can do, parsed out of IDENTIFY with the strings in reading order.
+typedef struct {
+    char model[41];
+    char serial[21];
+    char firmware[9];
+    uint16_t cylinders;
+    uint16_t heads;
+    uint16_t sectors_per_track;
+    uint32_t cfa_sectors;       // sectors per card, as the CF specific words report it
+    uint32_t lba28_sectors;
+    uint32_t lba48_sectors;     // 0 without the 48 bit feature set, clamped to 32 bits
+    bool lba48;                 // 48 bit feature set enabled
+    uint8_t max_multiple;       // sectors per READ/WRITE MULTIPLE block, 0 if not supported
+    uint8_t max_pio;            // fastest PIO mode the card claims
+    bool iordy;
+    uint16_t min_pio_cycle;     // ns, with or without IORDY to match, 0 if not reported
+    bool write_cache;           // has a volatile write cache
+    bool write_cache_enabled;
+    bool cfa;                   // CompactFlash feature set, CFA ERASE and WRITE WITHOUT ERASE
+} AtaCapabilities;
+
+// NULL when there is no card.
+const AtaCapabilities *ata_capabilities(void);
+
+// The identity and bus setup of the attached card, left out of ata_init to keep the boot fast.
+void ata_print_identity(void);
+// Transfer rate the bus setup should manage on long runs, from the measured word time.
+uint32_t ata_estimate_kbps(void);
+
+uint16_t ata_read_disk(uint32_t address, uint8_t *data, int count);
+uint16_t ata_write_disk(uint32_t address, uint8_t *data, int count);
+// CompactFlash pre-erase, sectors erased up front are written faster with ata_write_erased.
+uint16_t ata_erase_disk(uint32_t address, int count);
+uint16_t ata_write_erased(uint32_t address, uint8_t *data, int count);
+// Checks sectors on the card without transferring them, bad_lba gets the first bad one on a media error.
+uint16_t ata_verify_disk(uint32_t address, int count, uint32_t *bad_lba);
+
+#define ATA_OP_READ 0
+#define ATA_OP_WRITE 1
+#define ATA_OP_FLUSH 2  // lba and count are ignored, completes once everything written before it is durable
+#define ATA_OP_VERIFY 3 // READ VERIFY, the drive checks the sectors without sending them, data is ignored
+#define ATA_OP_WRITE_ERASED 4 // write into sectors pre-erased with ata_erase_disk, skipping the erase
+
+typedef struct AtaRequest AtaRequest;
+typedef void (*AtaCallback)(AtaRequest *req);
+
+// An asynchronous transfer, owned by the driver from ata_submit until done is called.
+struct AtaRequest {
+    uint8_t op;
+    uint32_t lba;
+    uint8_t *data;
+    int count;
+    AtaCallback done;   // called from ata_service once the request has finished
+    void *ctx;
+    uint16_t result;    // 0, or a packed status/error like the blocking calls return
+    uint32_t deadline;  // HAL tick, ata_queue serves the earliest first
+    uint32_t error_lba; // first bad sector, when result is a media error
+    AtaRequest *chain;  // driver private, the next request merged into the same commands
+};
+
+// Starts a request, returns 0 or ATA_ERR_BUSY / ATA_ERR_RANGE if it wasn't taken.
+// Failed requests are retried a few times with backoff before done sees the error.
+uint16_t ata_submit(AtaRequest *req);
+/**
+ * Adds a request to the queue, returns 0 or ATA_ERR_BUSY if the queue is full.
+ * Queued requests go to the drive earliest deadline first, adjacent ones with the same op
+ * are merged into a single command. Audio streams should use tight deadlines, metadata loose ones.
+ */
+uint16_t ata_queue(AtaRequest *req);
+// Takes a request back out of the queue, done isn't called. ATA_ERR_BUSY once it has gone to the drive.
+uint16_t ata_cancel(AtaRequest *req);
+
+typedef struct {
+    uint32_t queued;    // requests accepted by ata_queue
+    uint32_t commands;  // runs of merged requests started, queued / commands is the merge rate
+    uint32_t merged;    // requests that rode along on another one's command
+    uint32_t retries;   // commands tried again after an error, the blocking calls included
+    uint8_t depth;      // requests waiting right now
+    uint8_t max_depth;
+} AtaQueueStats;
+
+const AtaQueueStats *ata_queue_stats(void);
+
+// Moves the request in flight along, never waits on the drive. Call it from the main loop.
+void ata_service(void);
+bool ata_busy(void);
+// The longest a single ata_service call has taken so far.
+uint32_t ata_service_worst_ns(void);
@@ -0,0 +1,43 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Each slot holds a 512 byte sector plus a little bookkeeping, mind the 20 KB of RAM.
+#ifndef BLOCK_CACHE_SLOTS
+#define BLOCK_CACHE_SLOTS 4
+#endif
+
+// Dirty sectors are queued for write back this long after they were first changed.
+#ifndef BLOCK_CACHE_WRITEBACK_MS
+#define BLOCK_CACHE_WRITEBACK_MS 2000
+#endif
+
+/**
+ * Small write back cache for metadata sectors (MBR, tape header, ToC), keyed by LBA.
+ * Sectors are evicted least recently used first. The returned pointers are only good until
+ * the next call into the cache, so don't hold onto them across function calls.
+ */
+
+// Returns the cached sector, reading it from the card on a miss. NULL if the read failed.
+uint8_t *block_cache_get(uint32_t lba);
+
+// Returns a zeroed slot for a sector that is about to be overwritten completely, without reading it.
+uint8_t *block_cache_get_blank(uint32_t lba);
+
+// Marks a cached sector as changed, it gets written back by block_cache_service or block_cache_flush.
+void block_cache_dirty(uint32_t lba);
+
+// Writes every dirty sector back now and flushes the drive cache, returns 0 or the first ATA error.
+uint16_t block_cache_flush(void);
+
+// Queues write back of sectors that have been dirty for long enough. Call it from the main loop.
+void block_cache_service(void);
+
+// Forgets everything without writing it back, for when the card has gone away.
+void block_cache_invalidate(void);
+
+void block_cache_print_stats(void);
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef IDE_CONTROLLER_H
+#define IDE_CONTROLLER_H
+
 #include "stm32f1xx.h"
 #include "stdint.h"
 #include "stdbool.h"
@@ -10,9 +13,61 @@
 #define IDE_WRITE_STROBE_PIN 12
 #define IDE_READ_STROBE_PORT GPIOA
 #define IDE_READ_STROBE_PIN 11
+#define IDE_INTRQ_PORT GPIOC
+#define IDE_INTRQ_PIN 9
+// Registers 0-7 are in the command block (CS0), registers 8-15 in the control block (CS1)
+#define IDE_CS_PORT GPIOC
+#define IDE_CS0_PIN 8
+#define IDE_CS1_PIN 6
+#define IDE_REG_CONTROL_BLOCK 0x08
+// IORDY, pulled up so an unconnected line always reads ready
+#define IDE_IORDY_PORT GPIOC
+#define IDE_IORDY_PIN 7
+
+#define IDE_PIO_MODES 5
+// profiles 0-4 are the PIO modes, the rest are PIO 4 tuned down past the spec
+#define IDE_TUNED_PROFILES 4
+#define IDE_PROFILES (IDE_PIO_MODES + IDE_TUNED_PROFILES)
 
 void IDE_init();
 
+// Switches the bus timing to one of PIO modes 0-4, returns false for an unknown mode.
+bool IDE_set_pio_mode(uint8_t mode);
+
+uint8_t IDE_get_pio_mode();
+
+// Lets the drive stretch bus cycles past the PIO mode minimum with IORDY.
+// DMA transfers don't sample IORDY, they rely on their own latency padding.
+void IDE_set_iordy(bool enabled);
+
+// Minimum cycle time of a PIO mode in ns, or 0 for an unknown mode.
+uint16_t IDE_pio_cycle_ns(uint8_t mode);
+
+// Same as above for timing profiles, used when calibrating against a card.
+bool IDE_set_profile(uint8_t profile);
+
+uint8_t IDE_get_profile();
+
+uint16_t IDE_profile_cycle_ns(uint8_t profile);
+
 uint16_t IDE_read(uint8_t reg);
 
-void IDE_write(uint8_t reg, uint16_t value);
\ No newline at end of file
+void IDE_write(uint8_t reg, uint16_t value);
+
+void IDE_read_burst(uint8_t reg, uint16_t *dst, int n);
+
+void IDE_write_burst(uint8_t reg, const uint16_t *src, int n);
+
+typedef void (*IDE_Callback)(void *ctx);
+
+// Timer + DMA transfers, a polled IDE_read/IDE_write is still available when no transfer is running.
+bool IDE_dma_busy();
+
+bool IDE_dma_read(uint8_t reg, uint16_t *dst, int n, IDE_Callback cb, void *ctx);
+
+bool IDE_dma_write(uint8_t reg, const uint16_t *src, int n, IDE_Callback cb, void *ctx);
+
+// Called from interrupt context on the rising edge of the drive's INTRQ line.
+void IDE_set_intrq_callback(IDE_Callback cb, void *ctx);
+
+#endif
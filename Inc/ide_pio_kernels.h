@@ -0,0 +1,205 @@
+/**
+ * Polled IDE bus cycles for a single PIO mode.
+ *
+ * This is not a normal header, ide_controller.c includes it once per PIO mode with
+ * PIO_MODE and the PIO_* timings (in ns) defined, so every delay in here is a compile
+ * time constant. Short delays turn into straight NOP runs, only long ones fall back to
+ * the DWT stopwatch loop. The timing macros are undefined again at the end.
+ *
+ * In the fast modes the burst kernels run from RAM, to keep flash wait states and prefetch
+ * misses out of the cycle timing. The slow modes have enough slack not to need it.
+ *
+ * When IORDY is enabled the strobe is held for the mode minimum, then for as long as
+ * the drive keeps IORDY low (up to IDE_IORDY_TIMEOUT_NS), and released as soon as it is ready.
+ */
+
+#define PIO_FN(NAME) PIO_NAME(NAME##_pio, PIO_MODE)
+
+// the strobe has to stay high long enough to meet the recovery time,
+// the address hold time and the total cycle time.
+#define PIO_IDLE_NS (((PIO_CYCLE - PIO_DATA_SETUP) > PIO_RECOVERY) ? \
+        (((PIO_CYCLE - PIO_DATA_SETUP) > PIO_READ_HOLD) ? (PIO_CYCLE - PIO_DATA_SETUP) : PIO_READ_HOLD) : \
+        ((PIO_RECOVERY > PIO_READ_HOLD) ? PIO_RECOVERY : PIO_READ_HOLD))
+
+#if PIO_MODE >= 3
+#define PIO_BURST_SECTION RAMFUNC
+#else
+#define PIO_BURST_SECTION
+#endif
+
+#ifndef PIO_WAIT_IORDY
+#define PIO_WAIT_IORDY() { \
+    uint32_t iordy_start = STOPWATCH_GET_TICKS(); \
+    while (!(IDE_IORDY_PORT->IDR & (0x01 << IDE_IORDY_PIN)) && \
+        (STOPWATCH_GET_TICKS() - iordy_start) < STOPWATCH_NS_TO_TICKS(IDE_IORDY_TIMEOUT_NS)); }
+#endif
+
+// cycles spent in each bus phase
+#define PIO_ADDR_TICKS STOPWATCH_NS_TO_TICKS(PIO_ADDR_SETUP)
+#define PIO_DATA_TICKS STOPWATCH_NS_TO_TICKS(PIO_DATA_SETUP)
+#define PIO_STROBE_TICKS STOPWATCH_NS_TO_TICKS(PIO_DATA_SETUP - PIO_WRITE_SETUP)
+#define PIO_WSETUP_TICKS STOPWATCH_NS_TO_TICKS(PIO_WRITE_SETUP)
+#define PIO_WHOLD_TICKS STOPWATCH_NS_TO_TICKS(PIO_WRITE_HOLD)
+#define PIO_IDLE_TICKS STOPWATCH_NS_TO_TICKS(PIO_IDLE_NS)
+
+// each phase is rounded up from its own minimum and the idle phase makes up the rest of the cycle,
+// so the timing holds by construction. The write kernels wait out the hold inside the idle phase though.
+_Static_assert(PIO_IDLE_TICKS >= PIO_WHOLD_TICKS, "PIO write data hold is longer than the strobe recovery");
+
+static const PioTiming PIO_NAME(pio_timing_, PIO_MODE) = {
+    PIO_CYCLE, PIO_ADDR_SETUP, PIO_DATA_SETUP, PIO_RECOVERY, PIO_WRITE_SETUP, PIO_WRITE_HOLD, PIO_READ_HOLD
+};
+
+static uint16_t PIO_FN(IDE_read)(uint8_t reg) {
+    IDE_set_addr(reg);
+    //set port to read
+    IDE_DATA_PORT->ODR = IDE_ODR_READ;
+    IDE_DATA_PORT->CRL = IDE_PORT_READ;
+    IDE_DATA_PORT->CRH = IDE_PORT_READ;
+    //Address setup time;
+    STOPWATCH_DELAY_CONST(PIO_ADDR_TICKS);
+    // get data
+    // Set strobe pin
+    IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN + 16));
+    //data setup time
+    STOPWATCH_DELAY_CONST(PIO_DATA_TICKS);
+    if (iordy_enabled) {
+        PIO_WAIT_IORDY();
+    }
+    // read input data into destination
+    uint16_t result = IDE_DATA_PORT->IDR;
+    //clear strobe pin
+    IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN));
+    // recovery time
+    STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS);
+    return result;
+}
+
+static void PIO_FN(IDE_write)(uint8_t reg, uint16_t value) {
+    IDE_set_addr(reg);
+    //Address setup time;
+    STOPWATCH_DELAY_CONST(PIO_ADDR_TICKS);
+    // strobe the write pin.
+    IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN + 16));
+    STOPWATCH_DELAY_CONST(PIO_STROBE_TICKS);
+
+    // Push Value onto port
+    IDE_DATA_PORT->ODR = value;
+    // set port to write
+    IDE_DATA_PORT->CRL = IDE_PORT_WRITE;
+    IDE_DATA_PORT->CRH = IDE_PORT_WRITE;
+
+    // write setup time
+    STOPWATCH_DELAY_CONST(PIO_WSETUP_TICKS);
+    if (iordy_enabled) {
+        PIO_WAIT_IORDY();
+    }
+
+    //reset strobe
+    IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN));
+    // write hold time
+    STOPWATCH_DELAY_CONST(PIO_WHOLD_TICKS);
+    //set port back to read
+    IDE_DATA_PORT->ODR = IDE_ODR_READ;
+    IDE_DATA_PORT->CRL = IDE_PORT_READ;
+    IDE_DATA_PORT->CRH = IDE_PORT_READ;
+    // recovery time
+    STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS - PIO_WHOLD_TICKS);
+}
+
+PIO_BURST_SECTION static void PIO_FN(IDE_read_burst)(uint8_t reg, uint16_t *dst, int n) {
+    IDE_set_addr(reg);
+    //set port to read
+    IDE_DATA_PORT->ODR = IDE_ODR_READ;
+    IDE_DATA_PORT->CRL = IDE_PORT_READ;
+    IDE_DATA_PORT->CRH = IDE_PORT_READ;
+    //Address setup time, paid once for the whole burst;
+    STOPWATCH_DELAY_CONST(PIO_ADDR_TICKS);
+    // the IORDY check is hoisted out of the loop so the plain cycle stays tight.
+    if (iordy_enabled) {
+        for (int i = 0; i < n; i++) {
+            IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN + 16));
+            //data setup time
+            STOPWATCH_DELAY_CONST(PIO_DATA_TICKS);
+            PIO_WAIT_IORDY();
+            dst[i] = IDE_DATA_PORT->IDR;
+            IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN));
+            // recovery time
+            STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS);
+        }
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN + 16));
+        //data setup time
+        STOPWATCH_DELAY_CONST(PIO_DATA_TICKS);
+        dst[i] = IDE_DATA_PORT->IDR;
+        IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN));
+        // recovery time
+        STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS);
+    }
+}
+
+PIO_BURST_SECTION static void PIO_FN(IDE_write_burst)(uint8_t reg, const uint16_t *src, int n) {
+    IDE_set_addr(reg);
+    // set port to write, the previous word is held on the bus between strobes.
+    IDE_DATA_PORT->CRL = IDE_PORT_WRITE;
+    IDE_DATA_PORT->CRH = IDE_PORT_WRITE;
+    //Address setup time, paid once for the whole burst;
+    STOPWATCH_DELAY_CONST(PIO_ADDR_TICKS);
+    if (iordy_enabled) {
+        for (int i = 0; i < n; i++) {
+            IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN + 16));
+            // Push Value onto port
+            IDE_DATA_PORT->ODR = src[i];
+            // write setup time, the strobe must be held low for the full data setup time
+            STOPWATCH_DELAY_CONST(PIO_DATA_TICKS);
+            PIO_WAIT_IORDY();
+            IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN));
+            // recovery time, this also covers the write hold time.
+            STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS);
+        }
+    } else {
+        for (int i = 0; i < n; i++) {
+            IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN + 16));
+            // Push Value onto port
+            IDE_DATA_PORT->ODR = src[i];
+            // write setup time, the strobe must be held low for the full data setup time
+            STOPWATCH_DELAY_CONST(PIO_DATA_TICKS);
+            IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN));
+            // recovery time, this also covers the write hold time.
+            STOPWATCH_DELAY_CONST(PIO_IDLE_TICKS);
+        }
+    }
+    //set port back to read
+    IDE_DATA_PORT->ODR = IDE_ODR_READ;
+    IDE_DATA_PORT->CRL = IDE_PORT_READ;
+    IDE_DATA_PORT->CRH = IDE_PORT_READ;
+}
+
+static const PioKernels PIO_NAME(pio_kernels_, PIO_MODE) = {
+    &PIO_NAME(pio_timing_, PIO_MODE),
+    PIO_FN(IDE_read),
+    PIO_FN(IDE_write),
+    PIO_FN(IDE_read_burst),
+    PIO_FN(IDE_write_burst),
+};
+
+#undef PIO_FN
+#undef PIO_BURST_SECTION
+#undef PIO_IDLE_NS
+#undef PIO_ADDR_TICKS
+#undef PIO_DATA_TICKS
+#undef PIO_STROBE_TICKS
+#undef PIO_WSETUP_TICKS
+#undef PIO_WHOLD_TICKS
+#undef PIO_IDLE_TICKS
+
+#undef PIO_MODE
+#undef PIO_CYCLE
+#undef PIO_ADDR_SETUP
+#undef PIO_DATA_SETUP
+#undef PIO_RECOVERY
+#undef PIO_WRITE_SETUP
+#undef PIO_WRITE_HOLD
+#undef PIO_READ_HOLD
@@ -59,6 +59,13 @@ void Error_Handler(void);
 
 /* Private defines -----------------------------------------------------------*/
 /* USER CODE BEGIN Private defines */
+// PLL multiplier used by SystemClock_Config, the bus timing derives its cycle counts from this.
+#define SYSCLK_PLL_MUL RCC_PLL_MUL6
+#define SYSCLK_HZ (HSE_VALUE * ((SYSCLK_PLL_MUL >> RCC_CFGR_PLLMULL_Pos) + 2))
+
+// Places a function in the .ramfunc section, copied to RAM by the startup code.
+// Calls into it from flash are out of BL range, so they go through a long call.
+#define RAMFUNC __attribute__((section(".ramfunc"), long_call, noinline))
 
 /* USER CODE END Private defines */
 
@@ -0,0 +1,48 @@
+#ifndef OVERDUB_H
+#define OVERDUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Share of each ring, in time, the scheduler tries to keep in hand.
+#define OVERDUB_LOW_WATER_PCT 25
+// Per command cost on top of moving the data, status, task file and the card getting going.
+#define OVERDUB_COMMAND_US 1000
+// How often the card rate the transfers are sized by is brought up to date.
+#define OVERDUB_RATE_UPDATE_MS 100
+
+typedef struct {
+    uint32_t record_margin_ms;       // until the record ring overflows
+    uint32_t playback_margin_ms;     // until the playback ring runs dry
+    uint32_t record_min_margin_ms;   // the closest each came since overdub_start
+    uint32_t playback_min_margin_ms;
+    uint32_t record_low_water_ms;
+    uint32_t playback_low_water_ms;
+    uint32_t record_low_events;      // times each dipped below its low water mark
+    uint32_t playback_low_events;
+    uint32_t record_run;             // sectors per transfer, as sized right now
+    uint32_t playback_run;
+    uint32_t card_kbps;              // what the sizing assumes the card does
+} OverdubStats;
+
+/**
+ * Overdub scheduler, plays the tape and records onto it at the same time over the one bus.
+ * Both engines queue their transfers with deadlines of when their ring would run out, so the
+ * ATA queue serves whichever is closer to trouble first. On top of that the scheduler sizes
+ * each ring's transfers, so that while one is on the bus the other stays above its low water mark.
+ * With the interleaved layout the take has to go somewhere else on the tape than what is playing,
+ * a planar tape can play one track and record another alongside it over the same samples.
+ */
+
+// Locates playback, then starts recording at a sector of the record channel. Frames can flow both ways once it returns.
+uint16_t overdub_start(int play_channel, uint32_t play_sample, int record_channel, uint32_t record_lba);
+void overdub_stop(void);
+bool overdub_active(void);
+
+// Sizes the next transfers from the fill of both rings. Call it from the main loop, ahead of the engines.
+void overdub_service(void);
+
+const OverdubStats *overdub_stats(void);
+void overdub_print_stats(void);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PATCH_H
+#define PATCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Patches remembered, as many as fit into the one table sector.
+#define PATCH_MAX_ENTRIES 41
+// returned once the patch area or the table is full, next to the ATA_ERR_* codes.
+#define PATCH_ERR_FULL 0xFFF6
+
+/**
+ * Punch-in overlay for the tape. A patch covers a range of tape sectors with new audio kept in
+ * the reserved area, the tape underneath is left as it was. The table of them is a sorted list of
+ * ranges that never overlap, so finding what covers a sector is a binary search.
+ * Sectors of a patch that a later one covers up aren't handed out again until the next format.
+ */
+
+// Loads the table from table_lba, patches are placed from pool_lba on. A table that was never written starts out empty.
+void patch_load(uint32_t table_lba, uint32_t pool_lba, uint32_t pool_len);
+// Starts a fresh, empty table and queues it for writing, for a new format.
+uint16_t patch_format(uint32_t table_lba, uint32_t pool_lba, uint32_t pool_len);
+// Forgets the table, for when the card has gone away.
+void patch_unload(void);
+
+/**
+ * Whether a tape sector (tape relative) is patched. If it is, patch_lba gets the card LBA of its new
+ * audio. Either way run gets how many sectors on from it stay the same, patched or not.
+ */
+bool patch_lookup(uint32_t lba, uint32_t *run, uint32_t *patch_lba);
+
+// Puts a fresh patch over count tape sectors, on top of whatever covered them before.
+uint16_t patch_add(uint32_t lba, uint32_t count);
+// Uncovers count tape sectors again, what was underneath shows through.
+uint16_t patch_remove(uint32_t lba, uint32_t count);
+
+// Queues the table for writing, it's on the card after the next checkpoint.
+uint16_t patch_save(void);
+// Drops every change since the table was last saved.
+void patch_discard(void);
+
+void patch_print_stats(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef PLAYBACK_H
+#define PLAYBACK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// RAM ring between the card and the output side, in sectors. It shares the 20 KB with the record ring.
+#ifndef PLAYBACK_RING_SECTORS
+#define PLAYBACK_RING_SECTORS 4
+#endif
+
+// Most sectors per read while playing, a read goes out once that much room has opened up in the ring.
+// The overdub scheduler shortens it to leave the bus free for recording.
+#ifndef PLAYBACK_RUN_SECTORS
+#define PLAYBACK_RUN_SECTORS 2
+#endif
+
+// Sectors read by a locate before it returns. Small, the first sample only waits for this much.
+#ifndef PLAYBACK_PREROLL_SECTORS
+#define PLAYBACK_PREROLL_SECTORS 1
+#endif
+
+// Reads queued at once.
+#define PLAYBACK_RUNS 2
+
+// Longest a locate waits on the card, for reads still out or the pre-roll, before it gives up with ATA_ERR_TIMEOUT.
+#define PLAYBACK_WAIT_MS 1000
+
+typedef struct {
+    uint32_t sample;          // next frame playback_read hands out
+    uint32_t locate_us;       // time to first sample of the last locate, what the operator waits on
+    uint32_t worst_locate_us;
+    uint32_t locates;
+    uint32_t underruns;       // playback_read calls that got fewer frames than they asked for
+    uint32_t read_errors;     // runs the card couldn't read back, played as silence
+    uint32_t low_water;       // fewest bytes buffered at a playback_read since the locate
+    uint16_t error;           // what stopped playback early, 0 if nothing did
+    bool end_of_tape;
+} PlaybackStats;
+
+/**
+ * Read ahead playback engine. playback_locate moves to a sample and reads just enough to play
+ * it, then playback_service keeps the ring topped up behind the output side, which takes frames
+ * with playback_read. Frames are interleaved n_channels * bit_depth bytes for TAPE_ALL_CHANNELS
+ * on an interleaved tape, or single samples for one track of a planar tape.
+ */
+
+// Moves to a sample of a channel and blocks until it can be played, then read ahead carries on in the background.
+uint16_t playback_locate(int channel, uint32_t sample);
+void playback_stop(void);
+bool playback_active(void);
+// How far ahead to read, in sectors, clamped to the ring.
+void playback_set_readahead(uint32_t sectors);
+
+// Copies out up to n_frames whole frames, never waits. Safe to call from the output interrupt.
+uint32_t playback_read(uint8_t *frames, uint32_t n_frames);
+
+// Retires finished reads and queues more. Call it from the main loop.
+void playback_service(void);
+
+// Sectors per read, up to PLAYBACK_RUN_SECTORS.
+void playback_set_run_sectors(uint32_t sectors);
+// How long the output side can keep going on what's buffered, and how long the whole ring lasts.
+uint32_t playback_margin_ms(void);
+uint32_t playback_ring_ms(void);
+
+const PlaybackStats *playback_stats(void);
+void playback_print_stats(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// RAM ring between the capture side and the card, in sectors. Mind the 20 KB of RAM, see RING_RAM_BUDGET.
+#ifndef RECORD_RING_SECTORS
+#define RECORD_RING_SECTORS 8
+#endif
+
+// Most sectors per write, a write goes out once the ring has that many full and the rest keep filling
+// while it's on the bus. The overdub scheduler shortens it to leave the bus free for playback.
+#ifndef RECORD_RUN_SECTORS
+#define RECORD_RUN_SECTORS 4
+#endif
+
+// Writes queued at once, one on the bus and one waiting is enough to keep the drive busy.
+#define RECORD_RUNS 2
+
+typedef struct {
+    uint32_t position;       // sector of the stream the next full sector goes to
+    uint32_t sectors;        // written to the card this take
+    uint32_t overruns;       // record_write calls that couldn't take all their frames
+    uint32_t dropped_frames;
+    uint32_t high_water;     // most bytes waiting in the ring at once
+    uint32_t kbps;           // recorded rate since record_start
+    uint32_t card_kbps;      // rate the card writes at while it's busy with the take, what it can sustain
+    uint32_t max_channels;   // channels the card could carry at the tape's sample rate and word length
+    uint16_t error;          // what stopped the take early, 0 if nothing did
+    bool end_of_tape;
+} RecordStats;
+
+/**
+ * Streaming record engine. The capture side appends frames with record_write, and record_service
+ * writes the full sectors out to the tape behind it. Frames are interleaved n_channels * bit_depth
+ * bytes for TAPE_ALL_CHANNELS on an interleaved tape, or single samples for one track of a planar tape.
+ */
+
+// Starts a take at a sector of the channel's stream. Sectors still erased since formatDisk are written without an erase.
+uint16_t record_start(int channel, uint32_t lba);
+/**
+ * Punch-in, re-records count sectors of the channel's stream from lba into patches and leaves the
+ * tape underneath alone. It stops by itself at the end of the range, a punch-in stopped early only
+ * replaces what it got to. Nothing of it shows on the tape until it's done, a failed one changes nothing.
+ */
+uint16_t record_punch(int channel, uint32_t lba, uint32_t count);
+// Stops taking frames, what is left in the ring is padded out to a sector and written, then checkpointed.
+void record_stop(void);
+// True until the last sector of a stopped take is on the card.
+bool record_active(void);
+// The ring, at least RECORD_RUN_SECTORS long, for others to write runs from while no take is using it. NULL during one.
+uint8_t *record_borrow_ring(void);
+
+// Appends whole frames, returns how many were taken. Safe to call from the capture interrupt.
+uint32_t record_write(const uint8_t *frames, uint32_t n_frames);
+
+// Queues full runs and retires finished ones. Call it from the main loop.
+void record_service(void);
+
+// Sectors per write, up to RECORD_RUN_SECTORS.
+void record_set_run_sectors(uint32_t sectors);
+// How long the capture side can keep going before the ring overflows, and how long the whole ring lasts.
+uint32_t record_margin_ms(void);
+uint32_t record_ring_ms(void);
+
+const RecordStats *record_stats(void);
+void record_print_stats(void);
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef REMAP_H
+#define REMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Spare sectors set aside at the end of the reserved area, in front of the tape.
+#define REMAP_SPARE_SECTORS 64
+// Remapped sectors remembered, as many as fit into the one table sector.
+#define REMAP_MAX_ENTRIES 62
+// returned once there are no spares or table entries left, next to the ATA_ERR_* codes.
+#define REMAP_ERR_FULL 0xFFF8
+
+/**
+ * Bad sector remapping for the tape partition. Sectors the card can no longer write are
+ * redirected to spares, the table of them lives in a sector of the reserved area and a copy
+ * is kept in RAM behind a small hash, so a lookup on the read path is a probe or two.
+ */
+
+// Loads the table from table_lba, spares are taken from spare_lba on. A table that was never written starts out empty.
+void remap_load(uint32_t table_lba, uint32_t spare_lba, uint32_t spare_count);
+// Starts a fresh, empty table and writes it out, for a new format.
+uint16_t remap_format(uint32_t table_lba, uint32_t spare_lba, uint32_t spare_count);
+// Forgets the table, for when the card has gone away.
+void remap_unload(void);
+
+// Where lba really lives on the card, lba itself unless it was remapped.
+uint32_t remap_lookup(uint32_t lba);
+// Sectors from lba on, up to count, that can go to the card in one run without a remapped one in between.
+int remap_run(uint32_t lba, int count);
+
+// Moves lba to a fresh spare and writes data there, returns 0 or the error once the spares run out.
+uint16_t remap_sector(uint32_t lba, uint8_t *data);
+
+// Blocking transfers through the table, writes that fail on the card are remapped on the spot.
+uint16_t remap_read(uint32_t lba, uint8_t *data, int count);
+uint16_t remap_write(uint32_t lba, uint8_t *data, int count);
+
+void remap_print_stats(void);
+
+#endif
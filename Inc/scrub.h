@@ -0,0 +1,46 @@
+#ifndef SCRUB_H
+#define SCRUB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCRUB_CHUNK_SECTORS 64       // sectors per READ VERIFY, small enough not to hold up the audio
+#define SCRUB_PASS_INTERVAL_MS 60000 // rest between passes over the region
+#define SCRUB_MAX_BAD 8              // bad sectors remembered, more are still counted
+#define SCRUB_RETRY_MS 1000          // rest after a chunk failed for another reason than the media
+#define SCRUB_MAX_RETRIES 3          // tries at such a chunk before it is skipped
+
+// Regions a pass goes over in turn, the tape and the patches punched into it.
+#define SCRUB_REGIONS 2
+#define SCRUB_REGION_TAPE 0
+#define SCRUB_REGION_PATCHES 1
+
+typedef struct {
+    uint8_t region;      // region being scrubbed
+    uint32_t start;
+    uint32_t count;
+    uint32_t next;       // next sector to verify
+    uint32_t passes;     // completed passes over the region
+    uint32_t bad_total;
+    uint32_t skipped;    // chunks given up on after SCRUB_MAX_RETRIES failures
+    uint8_t bad_count;
+    uint32_t bad[SCRUB_MAX_BAD];
+} ScrubStatus;
+
+/**
+ * Background scrub, verifies regions of the card with READ VERIFY whenever the ATA queue
+ * is empty, and reports the sectors the drive can't read back.
+ */
+// Starts scrubbing from the first region, with lba and count as the tape.
+void scrub_start(uint32_t lba, uint32_t count);
+// Sets what a region covers, 0 sectors leaves it out. A pass already in it carries on over the old range.
+void scrub_region(int region, uint32_t lba, uint32_t count);
+void scrub_stop(void);
+bool scrub_active(void);
+
+// Issues the next chunk when the drive is idle. Call it from the main loop.
+void scrub_service(void);
+
+const ScrubStatus *scrub_status(void);
+
+#endif
@@ -1,12 +1,15 @@
 #include <stdint.h>
 #include "stm32f1xx.h"
+#include "main.h"
 
 /**
  * All Macro Library for nano second order blocking delays using the STM32 debug registers,
  * adapted from https://stackoverflow.com/a/19124472 
  */
 
-#define CLK_SPEED         48000000 // EXAMPLE for CortexM4, EDIT as needed
+#define CLK_SPEED         SYSCLK_HZ // derived from the PLL setup used by SystemClock_Config
+
+_Static_assert(CLK_SPEED % 1000000 == 0, "stopwatch conversions assume a whole MHz core clock");
 
 typedef struct {
     uint32_t m_nStart;               //DEBUG Stopwatch start cycle counter value
@@ -27,8 +30,18 @@ typedef struct {
 #define STOPWATCH_READ_TICKS(STOPWATCH) (STOPWATCH.m_nStop - STOPWATCH.m_nStart)
 
 #define STOPWATCH_GET_TICKS() (*DWT_CYCCNT)
-#define STOPWATCH_DELAY(TICKS) { uint32_t end_ticks = (uint32_t)(TICKS) + STOPWATCH_GET_TICKS(); while(1) { if (STOPWATCH_GET_TICKS() >= end_ticks) break; }}
+#define STOPWATCH_DELAY(TICKS) { uint32_t start_ticks = STOPWATCH_GET_TICKS(); while ((STOPWATCH_GET_TICKS() - start_ticks) < (uint32_t)(TICKS)); }
 #define STOPWATCH_RESET() { DEMCR |= DEMCR_TRCENA; *DWT_CYCCNT = 0; DWT_CTRL |= CYCCNTENA; }
 
-#define STOPWATCH_NS_TO_TICKS(NS) ((uint32_t)(((unsigned long long)(NS) * (unsigned long long)(CLK_SPEED)) / 1000000000ULL))
-#define STOPWATCH_TICKS_TO_NS(TICKS) ((uint32_t)(1000 * (uint32_t)(TICKS) / ((unsigned long long)(CLK_SPEED) / 1000000ULL)))
\ No newline at end of file
+// rounds up, a delay shorter than asked for is a bus timing violation.
+#define STOPWATCH_NS_TO_TICKS(NS) ((uint32_t)(((unsigned long long)(NS) * (unsigned long long)(CLK_SPEED) + 999999999ULL) / 1000000000ULL))
+#define STOPWATCH_TICKS_TO_NS(TICKS) ((uint32_t)(1000 * (uint32_t)(TICKS) / ((unsigned long long)(CLK_SPEED) / 1000000ULL)))
+
+/**
+ * Delays for a compile time constant number of ticks.
+ * Short delays are emitted as a run of NOPs, which is cycle exact and has none of the
+ * overhead of reading the DWT counter. Longer ones use the DWT loop to save flash.
+ */
+#define STOPWATCH_NOP_LIMIT 32
+#define STOPWATCH_DELAY_NOPS(TICKS) __asm volatile (".rept %c0\n\tnop\n\t.endr" : : "i" (TICKS))
+#define STOPWATCH_DELAY_CONST(TICKS) { if ((TICKS) <= STOPWATCH_NOP_LIMIT) { STOPWATCH_DELAY_NOPS(TICKS); } else STOPWATCH_DELAY(TICKS); }
@@ -0,0 +1,17 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+
+#define TIMELINE_MAX_MARKS 16
+
+/**
+ * Boot timeline, each phase of bringing the system up marks when it finished.
+ * Marks are cheap (a cycle counter read), printing is left until the system is ready.
+ * Phase names must be string literals, only the pointer is kept.
+ */
+void timeline_mark(const char *phase);
+
+void timeline_print(void);
+
+#endif
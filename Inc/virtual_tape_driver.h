@@ -0,0 +1,86 @@
+#ifndef VIRTUAL_TAPE_DRIVER_H
+#define VIRTUAL_TAPE_DRIVER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define TAPE_NAME_LEN 64
+
+// Every channel's sample of a frame next to each other, frame after frame.
+#define TAPE_LAYOUT_INTERLEAVED 0
+// Each channel in chunks of its own, chunk_sectors long, one chunk of every channel in turn.
+#define TAPE_LAYOUT_PLANAR 1
+// Stream of whole interleaved frames, rather than a single channel.
+#define TAPE_ALL_CHANNELS -1
+// Streams the header keeps erased marks for, channels past it on a planar tape never count as erased.
+#define TAPE_MAX_STREAMS 32
+
+typedef struct {
+    // AtaController *ata_drive;
+    bool disk_valid;                // is this disk formatted correctly
+    unsigned int header_offset_lba; // start of partition, in LBAs.
+    unsigned int tape_offset_lba;   // start of the linear data, in LBAs
+    unsigned int tape_len_lba;      // length of the linear data, in LBAs
+    unsigned char header_ver[2];    // data version of this disk [0] major, [1] minor
+    unsigned int n_channels;        // number of channels on this disk
+    unsigned int bit_depth;         // number of bytes per sample
+    unsigned int stride;            // offset between blocks, of a channel (=n_channels * bit_depth)
+    unsigned int sample_rate;       // samples per second, per channel
+    unsigned int layout;            // TAPE_LAYOUT_INTERLEAVED or TAPE_LAYOUT_PLANAR
+    unsigned int chunk_sectors;     // planar: sectors per channel chunk
+    char disk_name[TAPE_NAME_LEN];    // Label on this disk
+} VirtualTape;
+
+void initDisk();
+// The mounted tape, NULL if the card doesn't have a valid one.
+const VirtualTape *getTape();
+/**
+ * chunk_sectors lays the tape out planar, with each channel in runs of that many sectors, so a single
+ * track can be played or recorded on its own. 0 keeps the channels interleaved frame by frame.
+ * pre_erase erases the tape area on CF cards, which makes recording faster but the format a lot slower.
+ * The header then marks the tape as erased, see tapeErased.
+ */
+uint16_t formatDisk(uint32_t disk_len, uint8_t n_channels, uint32_t rate, uint16_t chunk_sectors, bool pre_erase);
+/**
+ * Makes the header, the tables and every write handed to the ATA driver before it durable, waiting
+ * for the ATA queue to drain first. Frames still in the record ring aren't covered, record_stop
+ * writes them out and checkpoints again once the take is over. Call it at checkpoint boundaries.
+ */
+uint16_t checkpointDisk();
+
+/**
+ * Streams, what the record and playback engines move. TAPE_ALL_CHANNELS is whole frames on an
+ * interleaved tape, a channel number is that one track on a planar tape. The other combinations
+ * would need every channel read and written back, they have a frame size of 0.
+ */
+uint32_t tapeFrameBytes(int channel);
+uint32_t tapeStreamSectors(int channel);
+// Tape LBA of a sector of the stream, run gets how many sectors of it follow on from there on the card.
+uint32_t tapeStreamLba(int channel, uint32_t sector, uint32_t *run);
+
+/**
+ * Erased marks, per stream the sector from which on it's still pre-erased since formatDisk, kept in
+ * the header. Only sectors at or past the mark can be written without an erase, everything written
+ * moves it on past. While a take is open the header stores the stream as not erased, so the mark
+ * on the card is never ahead of what was really written, power loss or not.
+ */
+bool tapeErased(int channel, uint32_t sector);
+uint16_t tapeOpenTake(int channel);
+// Moves the mark past sectors about to be written, durable before it returns unless a take is open.
+uint16_t tapeWritten(int channel, uint32_t sector, uint32_t count);
+// Stores the stream's real mark again, durable once it returns.
+uint16_t tapeCloseTake(int channel);
+
+// Card LBA a tape LBA is read from and written to, its punch-in patch if it has one. run gets how
+// many sectors on from it resolve the same way, so it takes one lookup per run rather than per sector.
+uint32_t tapeResolve(uint32_t lba, uint32_t *run, bool *patched);
+
+// Blocking access to the tape, in LBAs from its start, punch-ins included. Sectors that fail to write are remapped to spares.
+uint16_t readTape(uint32_t lba, uint8_t *data, int count);
+uint16_t writeTape(uint32_t lba, uint8_t *data, int count);
+
+// ATA hot-plug callbacks, mount the tape on a card as it comes and drop it as it goes.
+void onDriveAttach(uint32_t disk_len_lba, void *ctx);
+void onDriveDetach(void *ctx);
+
+#endif
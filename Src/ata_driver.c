@@ -2,6 +2,10 @@
 
 #include "ide_controller.h"
 #include "print.h"
+#include "stopwatch.h"
+#include "timeline.h"
+
+#include <string.h>
 
 #include "stm32f1xx_hal.h"
 
@@ -31,6 +35,22 @@
 #define ATA_COMMAND_IDENTIFY         0xEC
 #define ATA_COMMAND_READ_SECTOR      0x21
 #define ATA_COMMAND_WRITE_SECTOR     0x30
+#define ATA_COMMAND_SET_FEATURES     0xEF
+#define ATA_COMMAND_READ_MULTIPLE    0xC4
+#define ATA_COMMAND_WRITE_MULTIPLE   0xC5
+#define ATA_COMMAND_SET_MULTIPLE     0xC6
+#define ATA_COMMAND_READ_SECTOR_EXT  0x24
+#define ATA_COMMAND_WRITE_SECTOR_EXT 0x34
+#define ATA_COMMAND_READ_MULTIPLE_EXT  0x29
+#define ATA_COMMAND_WRITE_MULTIPLE_EXT 0x39
+#define ATA_COMMAND_FLUSH_CACHE      0xE7
+#define ATA_COMMAND_READ_VERIFY      0x40
+#define ATA_COMMAND_READ_VERIFY_EXT  0x42
+// CompactFlash specific, these only take LBA28 addresses
+#define ATA_COMMAND_CFA_ERASE        0xC0
+#define ATA_COMMAND_CFA_WRITE_NO_ERASE 0x38
+#define ATA_COMMAND_CFA_WRITE_MULTIPLE_NO_ERASE 0xCD
+#define ATA_COMMAND_FLUSH_CACHE_EXT  0xEA
 
 #define ATA_COMMAND_IDENTIFY_PACKET  0xA1
 
@@ -44,18 +64,23 @@
 #define ATA_REG_LBA0       0x03
 #define ATA_REG_LBA1       0x04
 #define ATA_REG_LBA2       0x05
+// with LBA48 the high bytes are written to the same registers first, then the low bytes
+#define ATA_REG_LBA3       0x03
+#define ATA_REG_LBA4       0x04
+#define ATA_REG_LBA5       0x05
 #define ATA_REG_HDDEVSEL   0x06
 #define ATA_REG_STATUS     0x07
 #define ATA_REG_COMMAND    0x07
-// Registers 8 - 15 are not supported by the hardware
+// Registers 8 - 15 are the control block, selected with CS1
+#define ATA_REG_ALTSTATUS  0x0E
+#define ATA_REG_CONTROL    0x0E
+#define ATA_REG_DEVADDRESS 0x0F
+
+// Device control register bits
 
-// #define ATA_REG_SECCOUNT1  0x08
-// #define ATA_REG_LBA3       0x09
-// #define ATA_REG_LBA4       0x0A
-// #define ATA_REG_LBA5       0x0B
-// #define ATA_REG_CONTROL    0x0C
-// #define ATA_REG_ALTSTATUS  0x0C
-// #define ATA_REG_DEVADDRESS 0x0D
+#define ATA_CTL_NIEN       0x02    // Disable INTRQ
+#define ATA_CTL_SRST       0x04    // Software reset
+#define ATA_CTL_HOB        0x80    // High order byte of 48 bit registers
 
 // The hardware is locked into master mode, so can't address the slave device. 
 // The hardware also only supports one channel. 
@@ -65,6 +90,32 @@
 #define ATA_MAGIC_SELMASTER 0xA0
 #define ATA_MAGIC_EN_LBA    0x40
 
+// LBA28 can address up to 128 GB, bits 24-27 go into the device select register
+#define ATA_LBA28_SECTORS   0x10000000
+
+// SET FEATURES subcommands, written to the features register
+#define ATA_FEATURE_SET_XFER_MODE 0x03
+#define ATA_FEATURE_WCACHE_ON     0x02
+#define ATA_FEATURE_WCACHE_OFF    0x82
+
+// Transfer mode values for ATA_FEATURE_SET_XFER_MODE, written to the sector count register
+#define ATA_XFER_PIO_FLOW   0x08    // PIO flow control mode, or'd with the mode number
+
+// IDENTIFY field bits
+#define ATA_ID_CAP_IORDY    0x0800  // capabilities: IORDY supported
+#define ATA_ID_VALID_64_70  0x0002  // validity: words 64-70 are valid
+#define ATA_ID_ADV_PIO3     0x0001  // advanced_pio_modes: PIO 3 supported
+#define ATA_ID_ADV_PIO4     0x0002  // advanced_pio_modes: PIO 4 supported
+#define ATA_ID_MAX_MULTIPLE 0x00FF  // max_sectors_op: most sectors per READ/WRITE MULTIPLE block
+#define ATA_ID_FEAT_LBA48   0x0400  // features word 83/86: 48 bit address feature set
+#define ATA_ID_FEAT_WCACHE  0x0020  // features word 82/85: volatile write cache
+#define ATA_ID_FEAT_CFA     0x0004  // features word 83: CFA feature set
+#define ATA_ID_SIG_CFA      0x848A  // signature of a CompactFlash card
+
+// a sector count of 0 asks for 256 sectors
+#define ATA_MAX_SECTORS 256
+#define ATA_SECTOR_WORDS 256
+
 typedef struct __attribute__((__packed__)) {
     uint16_t signature;
     uint16_t def_cylinders;
@@ -97,25 +148,184 @@ typedef struct __attribute__((__packed__)) {
     uint16_t __RESERVED_9[2];
     uint16_t min_pio_cycle_n_iordy;
     uint16_t min_pio_cycle_w_iordy;
-    char __RESERVED_10[24];
+    char __RESERVED_10[26];
     uint16_t features_supported_w[3];
     uint16_t features_enabled_w[3];
+    char __RESERVED_11[24];
+    uint16_t total_lba48_sectors_w[4];
     // There is more after this but secure erase is all that's up there, doesn't interest us.
-    char __RESERVED_11[334];
+    char __RESERVED_12[304];
 } DriveIdentity;
 
+_Static_assert(sizeof(DriveIdentity) == 512, "IDENTIFY data is one sector");
 
-uint16_t ata_poll() {
-    uint8_t status = 0;
-    while ((status = IDE_read(ATA_REG_STATUS)) & ATA_SR_BSY);
+
+// bus time is too slow to poll a stalled card forever, CF garbage collection can take tens of ms.
+#define ATA_TIMEOUT_MS 1000
+// drives get a lot longer to come back from a reset
+#define ATA_RESET_TIMEOUT_MS 5000
+#define ATA_RESET_RETRIES 3
+// emptying a write cache onto flash can take a while, the spec allows up to 30s.
+#define ATA_FLUSH_TIMEOUT_MS 30000
+// erasing up to 256 sectors at a time
+#define ATA_ERASE_TIMEOUT_MS 10000
+// bulk audio writes go through the drive's write cache, durability comes from ata_flush_cache.
+#define ATA_WRITE_CACHE_DEFAULT true
+// how often an idle bus is checked for a card coming or going
+#define ATA_HOTPLUG_POLL_MS 250
+// failed commands are tried again this many times, waiting twice as long before each one.
+#define ATA_RETRIES 3
+#define ATA_RETRY_BACKOFF_MS 2
+#define ATA_RETRY_BACKOFF_MAX_MS 50
+
+static volatile bool ata_irq_pending = false;
+static bool ata_use_intrq = false;
+// sectors per DRQ block with READ/WRITE MULTIPLE, 0 when it isn't enabled.
+static uint8_t ata_multiple = 0;
+// addressable sectors, and whether the EXT commands are needed to reach past LBA28.
+static uint32_t ata_sectors = 0;
+static bool ata_lba48 = false;
+
+static bool ata_attached = false;
+static AtaAttachCallback ata_attach_cb;
+static AtaDetachCallback ata_detach_cb;
+static void *ata_hotplug_ctx;
+
+// What the attached card can do, and how we set it up.
+static AtaCapabilities ata_caps;
+static bool ata_caps_valid = false;
+static uint8_t ata_pio_mode = 0;
+static bool ata_iordy = false;
+static uint8_t ata_profile = 0;
+static uint16_t ata_ns_per_word = 0;
+
+// state of the asynchronous request in flight, see ata_service.
+typedef enum {
+    ATA_STATE_IDLE,
+    ATA_STATE_READY,     // waiting for BSY to clear before the next command
+    ATA_STATE_DRQ,       // waiting for the drive to ask for the next block
+    ATA_STATE_TRANSFER,  // a block is moving over DMA
+    ATA_STATE_COMPLETE,  // waiting for a write command to finish
+    ATA_STATE_BACKOFF,   // waiting to try a failed request again
+} AtaState;
+
+static AtaState ata_state = ATA_STATE_IDLE;
+static AtaRequest *ata_req;        // head of the chain of requests sharing the commands
+static uint32_t ata_req_lba;       // next sector not yet covered by a command
+static int ata_req_left;           // sectors not yet covered by a command
+static AtaRequest *ata_seg;        // request whose buffer the bus is working on
+static int ata_seg_left;           // sectors left in its buffer
+static int ata_cmd_left;           // sectors left in the current command
+static uint8_t *ata_xfer_data;     // next sector to move
+static volatile int ata_xfer_left; // sectors left in the block on the bus
+static bool ata_expect_irq;        // the drive raises INTRQ when the current state is over
+static bool ata_cmd_ext;           // the command in flight uses the LBA48 task file
+static uint32_t ata_deadline;      // HAL tick the drive has to move by
+static int ata_req_attempts;       // retries the request in flight has had
+static uint32_t ata_worst_ticks;
+
+// Pending requests, waiting for the drive in deadline order. See ata_queue.
+#define ATA_QUEUE_SIZE 8
+// merging stops at one full command, so a long chain can't hold up an urgent request.
+#define ATA_QUEUE_MERGE_MAX ATA_MAX_SECTORS
+
+static AtaRequest *ata_queue_slots[ATA_QUEUE_SIZE];
+static AtaQueueStats ata_queue_counters;
+
+static AtaRequest *ata_queue_take(int i);
+
+static void ata_intrq(void *ctx) {
+    ata_irq_pending = true;
+}
+
+// Issues a command, arming the INTRQ flag first so the completion can't be missed.
+void ata_command(uint8_t command) {
+    ata_irq_pending = false;
+    IDE_write(ATA_REG_COMMAND, command);
+}
+
+/**
+ * Waits for BSY to clear, giving up after ATA_TIMEOUT_MS.
+ * Returns the final status, or ATA_ERR_TIMEOUT.
+ */
+static uint16_t ata_wait_busy_for(uint32_t timeout) {
+    uint32_t start = HAL_GetTick();
+    // poll the alternate status, it doesn't acknowledge the interrupt
+    while (IDE_read(ATA_REG_ALTSTATUS) & ATA_SR_BSY) {
+        if (HAL_GetTick() - start > timeout) {
+            return ATA_ERR_TIMEOUT;
+        }
+    }
+    // then read the real one once to clear INTRQ
+    return (uint8_t)IDE_read(ATA_REG_STATUS);
+}
+
+static uint16_t ata_wait_busy() {
+    return ata_wait_busy_for(ATA_TIMEOUT_MS);
+}
+
+// Sets the device control register, INTRQ is only left enabled when we are using it.
+static void ata_control(uint8_t bits) {
+    if (!ata_use_intrq) {
+        bits |= ATA_CTL_NIEN;
+    }
+    IDE_write(ATA_REG_CONTROL, bits);
+}
+
+/**
+ * Resets the drive with SRST, then waits for it to come back.
+ * Returns 0, or ATA_ERR_TIMEOUT if it is still busy.
+ */
+uint16_t ata_soft_reset() {
+    ata_control(ATA_CTL_SRST);
+    // SRST has to be held for at least 5us
+    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(5000));
+    ata_control(0);
+    // the drive has 2ms to raise BSY
+    HAL_Delay(2);
+    uint16_t status = ata_wait_busy_for(ATA_RESET_TIMEOUT_MS);
+    if (status == ATA_ERR_TIMEOUT) {
+        return ATA_ERR_TIMEOUT;
+    }
+    return 0;
+}
+
+/**
+ * Sleeps until the drive raises INTRQ for the last command, SysTick wakes us up each ms to check the timeout.
+ * Does nothing if the drive has no INTRQ, the caller falls back to polling the status register.
+ */
+static void ata_sleep_intrq(uint32_t timeout) {
+    if (!ata_use_intrq) {
+        return;
+    }
+    uint32_t start = HAL_GetTick();
+    while (!ata_irq_pending && (HAL_GetTick() - start) <= timeout) {
+        __WFI();
+    }
+}
+
+// Turns a status read into 0, or the packed error code.
+static uint16_t ata_status_error(uint16_t status) {
+    if (status == ATA_ERR_TIMEOUT) {
+        return ATA_ERR_TIMEOUT;
+    }
 
     if (status & ATA_SR_ERR) {
         uint8_t err = IDE_read(ATA_REG_ERROR);
-	return (err << 8) | status;
+        return (err << 8) | status;
     }
 
     if (status & ATA_SR_DF) {
-	return ATA_SR_DF;
+        return ATA_SR_DF;
+    }
+    return 0;
+}
+
+uint16_t ata_poll() {
+    uint16_t status = ata_wait_busy();
+    uint16_t err = ata_status_error(status);
+    if (err) {
+        return err;
     }
 
     if (status & ATA_SR_DRQ) {
@@ -125,17 +335,79 @@ uint16_t ata_poll() {
     return 0xFFFF;
 }
 
+/**
+ * Waits for a command without a data phase to complete.
+ * Returns 0, or the same packed error as ata_poll.
+ */
+static uint16_t ata_wait_for(uint32_t timeout) {
+    ata_sleep_intrq(timeout);
+    return ata_status_error(ata_wait_busy_for(timeout));
+}
+
+uint16_t ata_wait() {
+    return ata_wait_for(ATA_TIMEOUT_MS);
+}
 
-inline void ata_read_buffer(uint16_t *buffer, int size) {
-    for (int i = 0; i < size; i++) {
-        buffer[i] = IDE_read(ATA_REG_DATA);
+// Waits for the drive to be idle before a new command, unlike ata_poll it doesn't expect DRQ.
+static uint16_t ata_ready() {
+    return ata_status_error(ata_wait_busy());
+}
+
+/**
+ * Waits for a command to be ready to move a block of data into the host.
+ * The drive raises INTRQ when the block is ready, so we can sleep instead of hammering the bus.
+ */
+uint16_t ata_poll_intrq() {
+    ata_sleep_intrq(ATA_TIMEOUT_MS);
+    return ata_poll();
+}
+
+/**
+ * Worth trying again: timeouts, write faults and media errors, CF cards often recover from those
+ * once they've had a moment. Aborted commands, and the driver's own refusals, fail the same way every time.
+ */
+static bool ata_retryable(uint16_t err) {
+    if (err == ATA_ERR_TIMEOUT || err == 0xFFFF || err == ATA_SR_DF) {
+        return true;
     }
+    return ATA_ERR_FROM_DRIVE(err) && !((err >> 8) & ATA_ER_ABRT);
 }
 
-inline void ata_write_buffer(uint16_t *buffer, int size) {
-    for (int i = 0; i < size; i++) {
-        IDE_write(ATA_REG_DATA, buffer[i]);
+static uint32_t ata_backoff_ms(int attempt) {
+    uint32_t ms = ATA_RETRY_BACKOFF_MS << attempt;
+    return ms < ATA_RETRY_BACKOFF_MAX_MS ? ms : ATA_RETRY_BACKOFF_MAX_MS;
+}
+
+/**
+ * Gets the drive ready to take a failed command again. A drive that timed out or lost track of
+ * the data phase may still be sitting in the old command, it gets a reset.
+ */
+static void ata_recover(uint16_t err) {
+    if (err == ATA_ERR_TIMEOUT || err == 0xFFFF) {
+        ata_soft_reset();
+    }
+    ata_queue_counters.retries++;
+}
+
+/**
+ * Decides whether a blocking command that failed with err gets another go, backing off first.
+ * attempt counts the retries so far.
+ */
+static bool ata_retry(uint16_t err, int attempt) {
+    if (!ata_retryable(err) || attempt >= ATA_RETRIES || !ata_attached) {
+        return false;
     }
+    ata_recover(err);
+    HAL_Delay(ata_backoff_ms(attempt));
+    return true;
+}
+
+inline void ata_read_buffer(uint16_t *buffer, int size) {
+    IDE_read_burst(ATA_REG_DATA, buffer, size);
+}
+
+inline void ata_write_buffer(uint16_t *buffer, int size) {
+    IDE_write_burst(ATA_REG_DATA, buffer, size);
 }
 
 uint32_t convert_uint32_be(uint32_t a) {
@@ -158,151 +430,1134 @@ uint32_t convert_uint32_be(uint32_t a) {
 
 uint8_t ide_buffer[512] = {0};
 
-void ata_init() {
-    bool dump = false;
-    bool detected;
-    start:
-    // Todo: bail if card not detected (RN not supported in HW) 
-    detected = false;
-    do {
-        HAL_Delay(1000); // wait 1s for the card to boot up and or be plugged in;
-        
-        print("ATA Selecting Master\r\n");
-        IDE_write(ATA_REG_COMMAND, ATA_MAGIC_SELMASTER);
-        HAL_Delay(100); // wait 10ms for master select to work. 
-
-        // issue identify command
-        print("ATA Issuing Identify\r\n");
-        IDE_write(ATA_REG_COMMAND, ATA_COMMAND_IDENTIFY);
-        HAL_Delay(10);
-        if (IDE_read(ATA_REG_STATUS) == 0) {
-            print("ATA Driver believes no device present, waiting.\r\n");
-        } else {
-            detected = true;
+// Selects the master and issues IDENTIFY, returns false if nothing answered.
+static bool ata_identify() {
+    // a card still coming out of power on reset holds BSY and ignores everything else.
+    // an empty slot reads as 0, the data bus is pulled down.
+    uint16_t status = ata_wait_busy_for(ATA_RESET_TIMEOUT_MS);
+    if (status == ATA_ERR_TIMEOUT || status == 0) {
+        return false;
+    }
+    IDE_write(ATA_REG_HDDEVSEL, ATA_MAGIC_SELMASTER);
+    status = ata_wait_busy();
+    if (status == ATA_ERR_TIMEOUT || !(status & ATA_SR_DRDY)) {
+        return false;
+    }
+    ata_command(ATA_COMMAND_IDENTIFY);
+    return true;
+}
+
+// A card is there if the status register reads as anything but the floating bus.
+static bool ata_card_present() {
+    uint8_t status = IDE_read(ATA_REG_ALTSTATUS);
+    return status != 0x00 && status != 0xFF;
+}
+
+// Tells the drive about a PIO mode with SET FEATURES, then switches the bus. Returns the mode in use.
+static uint8_t ata_apply_pio(uint8_t mode, bool iordy) {
+    if (mode > 0) {
+        IDE_write(ATA_REG_FEATURES, ATA_FEATURE_SET_XFER_MODE);
+        IDE_write(ATA_REG_SECCOUNT, ATA_XFER_PIO_FLOW | mode);
+        ata_command(ATA_COMMAND_SET_FEATURES);
+        uint16_t err = ata_wait();
+        if (err) {
+            print("ATA PIO %u rejected: 0x%04x, staying in PIO 0\r\n", mode, err);
+            mode = 0;
         }
-    } while (!detected);
-    
-    // spin while card is busy
-    uint16_t err = ata_poll();
-    if (err) {
-        goto start;
     }
+    IDE_set_pio_mode(mode);
+    IDE_set_iordy(iordy);
+    return mode;
+}
 
-    uint16_t status = IDE_read(ATA_REG_STATUS);
-    if (status & ATA_SR_ERR) {
-        uint16_t error = IDE_read(ATA_SR_ERR);
-        print("ATA Reads Error: 0x%02x\r\n", (uint8_t)error);
-        // BAIL
+// Copies an IDENTIFY string, which has the bytes of every word swapped, into reading order.
+static void ata_id_string(char *dst, const char *src, int len) {
+    for (int i = 0; i < len; i += 2) {
+        dst[i] = src[i + 1];
+        dst[i + 1] = src[i];
+    }
+    // padded with spaces, trim them off.
+    while (len > 0 && dst[len - 1] == ' ') {
+        len--;
+    }
+    dst[len] = '\0';
+}
+
+/**
+ * Reads what we care about out of the raw IDENTIFY data, in host order.
+ */
+static void ata_parse_identity(const DriveIdentity *ident, AtaCapabilities *caps) {
+    memset(caps, 0, sizeof(*caps));
+    ata_id_string(caps->model, ident->model_no, sizeof(ident->model_no));
+    ata_id_string(caps->serial, ident->serial_no, sizeof(ident->serial_no));
+    ata_id_string(caps->firmware, ident->firmware_rev, sizeof(ident->firmware_rev));
+    caps->cylinders = ident->def_cylinders;
+    caps->heads = ident->def_heads;
+    caps->sectors_per_track = ident->def_sectors;
+    // the CF sector count has the high word first.
+    caps->cfa_sectors = ((uint32_t)ident->num_sectors_w[0] << 16) | ident->num_sectors_w[1];
+    caps->lba28_sectors = ident->total_lba_sectors_w;
+
+    if ((ident->features_supported_w[1] & ATA_ID_FEAT_LBA48) && (ident->features_enabled_w[1] & ATA_ID_FEAT_LBA48)) {
+        caps->lba48 = true;
+        // sector numbers above 32 bits would be a 2 TB card, we can't address those anyway.
+        caps->lba48_sectors = ident->total_lba48_sectors_w[0] | ((uint32_t)ident->total_lba48_sectors_w[1] << 16);
+        if (ident->total_lba48_sectors_w[2] || ident->total_lba48_sectors_w[3]) {
+            caps->lba48_sectors = 0xFFFFFFFF;
+        }
+    }
+    caps->max_multiple = ident->max_sectors_op & ATA_ID_MAX_MULTIPLE;
+
+    // the legacy field holds the highest of modes 0-2 in its upper byte.
+    caps->max_pio = ident->timing_mode >> 8;
+    if (caps->max_pio > 2) {
+        caps->max_pio = 2;
+    }
+    caps->iordy = (ident->capabilities & ATA_ID_CAP_IORDY) != 0;
+    if (ident->validity & ATA_ID_VALID_64_70) {
+        if (ident->advanced_pio_modes & ATA_ID_ADV_PIO4) {
+            caps->max_pio = 4;
+        } else if (ident->advanced_pio_modes & ATA_ID_ADV_PIO3) {
+            caps->max_pio = 3;
+        }
+        // If the drive supports IORDY it gets to stretch cycles it can't keep up with, so the
+        // minimum cycle with flow control applies, otherwise the one without.
+        caps->min_pio_cycle = caps->iordy ? ident->min_pio_cycle_w_iordy : ident->min_pio_cycle_n_iordy;
+    }
+
+    caps->write_cache = (ident->features_supported_w[0] & ATA_ID_FEAT_WCACHE) != 0;
+    caps->write_cache_enabled = (ident->features_enabled_w[0] & ATA_ID_FEAT_WCACHE) != 0;
+    caps->cfa = ident->signature == ATA_ID_SIG_CFA || (ident->features_supported_w[1] & ATA_ID_FEAT_CFA);
+}
+
+/**
+ * Picks the fastest PIO mode the drive reports, within its minimum cycle time.
+ * The drive is told about the mode with SET FEATURES before the bus is switched.
+ */
+void ata_negotiate_pio(const AtaCapabilities *caps) {
+    uint8_t mode = caps->max_pio;
+    // back off until the mode cycle is no faster than the drive can take.
+    while (mode > 0 && IDE_pio_cycle_ns(mode) < caps->min_pio_cycle) {
+        mode--;
+    }
+    ata_pio_mode = ata_apply_pio(mode, caps->iordy);
+    ata_iordy = caps->iordy;
+}
+
+// Times a burst of status reads to get the real cost of a word on the bus.
+static uint16_t ata_measure_word_ns() {
+    uint16_t words[32];
+    Stopwatch_t sw;
+    STOPWATCH_START(sw);
+    IDE_read_burst(ATA_REG_STATUS, words, 32);
+    STOPWATCH_STOP(sw);
+    return STOPWATCH_TICKS_TO_NS(STOPWATCH_READ_TICKS(sw)) / 32;
+}
+
+/**
+ * Works out how much of the card we can address. LBA48 is only used when the drive
+ * has it enabled and is too big for LBA28, the EXT commands need twice the register writes.
+ */
+void ata_set_capacity(const AtaCapabilities *caps) {
+    ata_sectors = caps->lba28_sectors;
+    if (caps->lba48_sectors > ata_sectors) {
+        ata_sectors = caps->lba48_sectors;
+    }
+    ata_lba48 = caps->lba48 && ata_sectors > ATA_LBA28_SECTORS;
+}
+
+/**
+ * Enables READ/WRITE MULTIPLE with the largest block the drive takes, so a whole block of
+ * sectors moves per DRQ handshake. The block has to be a power of two.
+ */
+void ata_set_multiple(const AtaCapabilities *caps) {
+    uint8_t max = caps->max_multiple;
+    uint8_t block = 0;
+    if (max > 1) {
+        block = 1;
+        while (block * 2 <= max) {
+            block *= 2;
+        }
+    }
+    ata_multiple = 0;
+    if (!block) {
         return;
     }
-    print("ATA STATUS now: 0x%02x\r\n", (uint8_t)status);
-    ata_read_buffer((uint16_t *)ide_buffer, 256);
-    
-    if (dump) {
-        print("ATA: Identity > ");
-        hexdump(ide_buffer, sizeof(ide_buffer));
+
+    IDE_write(ATA_REG_SECCOUNT, block);
+    ata_command(ATA_COMMAND_SET_MULTIPLE);
+    uint16_t err = ata_wait();
+    if (err) {
+        print("ATA SET MULTIPLE %u rejected: 0x%04x\r\n", block, err);
+        return;
+    }
+    ata_multiple = block;
+}
+
+/**
+ * Turns the drive's volatile write cache on or off with SET FEATURES.
+ * With it on a write completes once the data is in the cache, ata_flush_cache makes it durable.
+ */
+uint16_t ata_set_write_cache(bool enabled) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (!ata_caps.write_cache) {
+        return enabled ? ATA_ERR_UNSUPPORTED : 0;
+    }
+    uint16_t err = ata_ready();
+    if (err) {
+        return err;
+    }
+    IDE_write(ATA_REG_FEATURES, enabled ? ATA_FEATURE_WCACHE_ON : ATA_FEATURE_WCACHE_OFF);
+    ata_command(ATA_COMMAND_SET_FEATURES);
+    err = ata_wait();
+    if (!err) {
+        ata_caps.write_cache_enabled = enabled;
     }
+    return err;
+}
 
-    DriveIdentity *ident = (DriveIdentity *)ide_buffer;
-    print("signature: %u\r\n", ident->signature);
-    
-    print("Drive Model: ");
-    print_fixed_str(ident->model_no, 20);
-    print("Drive_Serial: ");
-    print_fixed_str(ident->serial_no, 20);
-    print("Drive Firmware Rev: ");
-    print_fixed_str(ident->firmware_rev, 8);
-    
-    uint32_t def_sectors = ident->total_lba_sectors_w;
-    print("Def  C:%u H:%u S:%u -- LBAs: %u\r\n", ident->def_cylinders, ident->def_heads, ident->def_sectors, def_sectors);
+static uint8_t ata_flush_command() {
+    return ata_lba48 ? ATA_COMMAND_FLUSH_CACHE_EXT : ATA_COMMAND_FLUSH_CACHE;
+}
 
-    uint32_t curr_sectors = ident->curr_lba_sectors_w;
-    print("Curr C:%u H:%u S:%u -- LBAs: %u\r\n", ident->curr_cyclinders, ident->curr_heads, ident->curr_sectors, curr_sectors);
+/**
+ * Barrier, returns once every write the drive has completed so far is on the media.
+ * Costs nothing when the drive has no write cache.
+ */
+uint16_t ata_flush_cache() {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (!ata_caps.write_cache) {
+        return 0;
+    }
+    uint16_t err = ata_ready();
+    if (err) {
+        return err;
+    }
+    ata_command(ata_flush_command());
+    return ata_wait_for(ATA_FLUSH_TIMEOUT_MS);
+}
+
+// Bus timing calibration, see ata_calibrate
+#define ATA_CAL_GUARD 1       // profiles to back off from the fastest one that passed
+#define ATA_CAL_PASSES 4      // pattern passes over the scratch sector per profile
+#define ATA_CAL_CACHE_SIZE 4  // cards remembered by serial number
+
+typedef struct {
+    char serial_no[20];
+    uint8_t profile;
+} CalibrationEntry;
 
-    print("Capabilities: %04x\r\n", ident->capabilities);
+static CalibrationEntry cal_cache[ATA_CAL_CACHE_SIZE];
+static uint8_t cal_cache_next = 0;
 
-    print("Timing Mode: %04x, Advanced PIO: %04x, Timing: %04x, %04x\r\n", ident->timing_mode, ident->advanced_pio_modes, ident->min_pio_cycle_n_iordy, ident->min_pio_cycle_w_iordy);
+// the scratch sector's original contents, put back once we are done with it. Or LBA 0 as read
+// at the safe timing, when there is no scratch sector and the passes only read.
+static uint16_t cal_saved[256];
+static uint32_t ata_scratch_lba = ATA_NO_SCRATCH;
 
-    print("ATA: Reading MBR\r\n");
-    ata_read_disk(0, ide_buffer, 1);
+void ata_set_scratch_sector(uint32_t lba) {
+    ata_scratch_lba = lba;
+}
 
-    if (dump) {
-        print("ATA MBR > ");
-        hexdump(ide_buffer, sizeof ide_buffer);
+static uint16_t ata_cal_word(int i, int pass) {
+    switch (pass) {
+        case 0: return 0x0001 << (i & 0xF);            // walking one
+        case 1: return ~(0x0001 << (i & 0xF));         // walking zero
+        case 2: return (i & 1) ? 0xAAAA : 0x5555;      // every line toggling
+        default: return (uint16_t)(i * 0x9E37 + pass); // address dependent
     }
+}
 
-    // Mbr *mbr = (Mbr*) ide_buffer;
+// Walks a bit through the LBA registers, like the bit test in main does.
+static bool ata_cal_registers() {
+    for (int bit = 0; bit < 8; bit++) {
+        uint8_t value = 0x01 << bit;
+        IDE_write(ATA_REG_LBA0, value);
+        IDE_write(ATA_REG_LBA1, ~value);
+        if ((uint8_t)IDE_read(ATA_REG_LBA0) != value || (uint8_t)IDE_read(ATA_REG_LBA1) != (uint8_t)~value) {
+            return false;
+        }
+    }
+    return true;
+}
 
-    // print("Partition [0]: Bootable:%i Start: %02x:%02x:%02x End: %02x:%02x:%02x LBA: %u - %u\n\r",
-    //     mbr->partition[0].bootable != 0,
-    //     mbr->partition[0].start_cylinder, mbr->partition[0].start_head, mbr->partition[0].start_sector,
-    //     mbr->partition[0].end_cylinder, mbr->partition[0].end_head, mbr->partition[0].end_sector,
-    //     convert_uint32_be(mbr->partition[0].start_lba_sector), convert_uint32_be(mbr->partition[0].lba_sector_count));
-    // 
-    // print("Partition [1]: Bootable:%i Start: %02x:%02x:%02x End: %02x:%02x:%02x LBA: %u - %u\r\n",
-    //     mbr->partition[1].bootable != 0,
-    //     mbr->partition[1].start_cylinder, mbr->partition[1].start_head, mbr->partition[1].start_sector,
-    //     mbr->partition[1].end_cylinder, mbr->partition[1].end_head, mbr->partition[1].end_sector,
-    //     convert_uint32_be(mbr->partition[1].start_lba_sector), convert_uint32_be(mbr->partition[1].lba_sector_count));
-    // 
-    // print("Partition [2]: Bootable:%i Start: %02x:%02x:%02x End: %02x:%02x:%02x LBA: %u - %u\r\n",
-    //     mbr->partition[2].bootable != 0,
-    //     mbr->partition[2].start_cylinder, mbr->partition[2].start_head, mbr->partition[2].start_sector,
-    //     mbr->partition[2].end_cylinder, mbr->partition[2].end_head, mbr->partition[2].end_sector,
-    //     convert_uint32_be(mbr->partition[2].start_lba_sector), convert_uint32_be(mbr->partition[2].lba_sector_count));
+// Writes and reads back the scratch sector with every pattern.
+static bool ata_cal_sector(uint32_t lba) {
+    uint16_t *words = (uint16_t *)ide_buffer;
+    for (int pass = 0; pass < ATA_CAL_PASSES; pass++) {
+        for (int i = 0; i < 256; i++) {
+            words[i] = ata_cal_word(i, pass);
+        }
+        if (ata_write_disk(lba, ide_buffer, 1) || ata_read_disk(lba, ide_buffer, 1)) {
+            return false;
+        }
+        for (int i = 0; i < 256; i++) {
+            if (words[i] != ata_cal_word(i, pass)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
 
-    // print("Partition [3]: Bootable:%i Start: %02x:%02x:%02x End: %02x:%02x:%02x LBA: %u - %u\r\n",
-    //     mbr->partition[3].bootable != 0,
-    //     mbr->partition[3].start_cylinder, mbr->partition[3].start_head, mbr->partition[3].start_sector,
-    //     mbr->partition[3].end_cylinder, mbr->partition[3].end_head, mbr->partition[3].end_sector,
-    //     convert_uint32_be(mbr->partition[3].start_lba_sector), convert_uint32_be(mbr->partition[3].lba_sector_count));
+// Reads a sector back over and over, it has to match what the safe timing read every time.
+static bool ata_cal_compare(uint32_t lba) {
+    for (int pass = 0; pass < ATA_CAL_PASSES; pass++) {
+        if (ata_read_disk(lba, ide_buffer, 1) || memcmp(ide_buffer, cal_saved, sizeof(cal_saved)) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
 
+// Puts the scratch sector back, once more after a reset if the first go fails. Returns false if it couldn't.
+static bool ata_cal_restore(uint32_t lba) {
+    uint16_t err = ata_write_disk(lba, (uint8_t *)cal_saved, 1);
+    if (err) {
+        ata_soft_reset();
+        err = ata_write_disk(lba, (uint8_t *)cal_saved, 1);
+    }
+    if (err) {
+        print("ATA calibration: FAILED TO RESTORE scratch sector %u, error 0x%04x, its contents are lost\r\n", lba, err);
+        return false;
+    }
+    return true;
 }
 
-uint16_t ata_read_disk(uint16_t address, uint8_t *data, int count) {
-    // spin while card is busy
-    HAL_Delay(1);
+/**
+ * Steps the bus timing down past PIO 4 through the tuned profiles, checking the card
+ * at each one, then settles on the fastest that passed less ATA_CAL_GUARD profiles.
+ * Only a sector set aside with ata_set_scratch_sector is ever written, and put back afterwards.
+ * Any other card is only read, which checks the read side of the bus but not the write side.
+ * Results are cached by serial number, so a card we have seen before skips straight to its profile.
+ */
+void ata_calibrate(const AtaCapabilities *caps) {
+    // only cards that can do PIO 4 properly are worth pushing past it.
+    uint8_t safe = IDE_get_profile();
+    if (safe != IDE_PIO_MODES - 1) {
+        return;
+    }
+
+    char serial[20];
+    strncpy(serial, caps->serial, sizeof(serial));
+    for (int i = 0; i < ATA_CAL_CACHE_SIZE; i++) {
+        if (cal_cache[i].profile && memcmp(cal_cache[i].serial_no, serial, sizeof(serial)) == 0) {
+            IDE_set_profile(cal_cache[i].profile);
+            return;
+        }
+    }
+
+    // the tuned profiles write and read back the reserved sector only, never anything past it.
+    bool writable = ata_scratch_lba < ata_sectors;
+    uint32_t lba = writable ? ata_scratch_lba : 0;
+    if (ata_read_disk(lba, (uint8_t *)cal_saved, 1)) {
+        print("ATA calibration skipped, can't read sector %u\r\n", lba);
+        return;
+    }
+
+    uint8_t best = safe;
+    for (uint8_t p = safe + 1; p < IDE_PROFILES; p++) {
+        IDE_set_profile(p);
+        if (!ata_cal_registers() || !(writable ? ata_cal_sector(lba) : ata_cal_compare(lba))) {
+            break;
+        }
+        best = p;
+    }
+
+    uint8_t chosen = (best - safe > ATA_CAL_GUARD) ? best - ATA_CAL_GUARD : safe;
+    // clean up at the known good timing, a failed pass may have left the card confused.
+    IDE_set_profile(safe);
+    if (best != IDE_PROFILES - 1) {
+        ata_soft_reset();
+    }
+    if (writable && !ata_cal_restore(lba)) {
+        // the card isn't behaving, stay at the safe timing and try again next time it's attached.
+        return;
+    }
+    IDE_set_profile(chosen);
+
+    memcpy(cal_cache[cal_cache_next].serial_no, serial, sizeof(serial));
+    cal_cache[cal_cache_next].profile = chosen;
+    cal_cache_next = (cal_cache_next + 1) % ATA_CAL_CACHE_SIZE;
+}
+
+/**
+ * Brings up the card in the slot. Every wait is on the drive's status, bounded by the reset timeout.
+ * A card we attached before is recognised by its serial number and gets the PIO mode and bus
+ * profile it had last time, without negotiating or calibrating again.
+ */
+static bool ata_attach() {
+    ata_use_intrq = false;
+    if (!ata_identify()) {
+        return false;
+    }
     uint16_t err = ata_poll();
+    for (int retry = 0; err && retry < ATA_RESET_RETRIES; retry++) {
+        // a hung card is recovered with a software reset, rather than waiting for it to come back
+        print("ATA Identify failed: 0x%04x, resetting\r\n", err);
+        err = ata_soft_reset();
+        if (!err) {
+            // the reset went out with nIEN set, as INTRQ isn't known to work yet. Clear it straight
+            // on the register, ata_control would set it again, or identify can't tell if the line is wired.
+            IDE_write(ATA_REG_CONTROL, 0);
+            err = ata_identify() ? ata_poll() : 0xFFFF;
+        }
+    }
     if (err) {
-	return err;
+        return false;
+    }
+    // identify raises INTRQ when its data is ready, if it didn't the line isn't wired up.
+    ata_use_intrq = ata_irq_pending;
+    ata_control(0);
+    ata_read_buffer((uint16_t *)ide_buffer, 256);
+    ata_attached = true;
+    timeline_mark("ata identify");
+
+    AtaCapabilities caps;
+    ata_parse_identity((DriveIdentity *)ide_buffer, &caps);
+    bool known = ata_caps_valid && strcmp(caps.serial, ata_caps.serial) == 0 && caps.lba28_sectors == ata_caps.lba28_sectors;
+    ata_caps = caps;
+    ata_caps_valid = true;
+
+    // everything from here on is chosen from the capabilities, ide_buffer is free again.
+    ata_set_capacity(&ata_caps);
+    ata_set_multiple(&ata_caps);
+    if (ata_caps.write_cache) {
+        ata_set_write_cache(ATA_WRITE_CACHE_DEFAULT);
     }
-    
-    IDE_write(ATA_REG_SECCOUNT, 1);
-    IDE_write(ATA_REG_LBA0, address & 0xFF);
-    IDE_write(ATA_REG_LBA1, address >> 8);
-    IDE_write(ATA_REG_LBA2, 0);
-    IDE_write(ATA_REG_HDDEVSEL, 0xE0);
-    IDE_write(ATA_REG_COMMAND, ATA_COMMAND_READ_SECTOR);
+    bool calibrate = false;
+    if (known && ata_apply_pio(ata_pio_mode, ata_iordy) == ata_pio_mode) {
+        IDE_set_profile(ata_profile);
+    } else {
+        ata_negotiate_pio(&ata_caps);
+        calibrate = true;
+    }
+    timeline_mark("ata configured");
 
-    err = ata_poll();
+    // the callback mounts whatever is on the card at the safe timing, and tells us if it has a
+    // scratch sector, calibration only writes to one the format set aside.
+    ata_scratch_lba = ATA_NO_SCRATCH;
+    if (ata_attach_cb) {
+        ata_attach_cb(ata_sectors, ata_hotplug_ctx);
+    }
+    if (calibrate) {
+        ata_calibrate(&ata_caps);
+        ata_profile = IDE_get_profile();
+        ata_ns_per_word = ata_measure_word_ns();
+        timeline_mark("ata calibrated");
+    }
+    return true;
+}
+
+static void ata_detach() {
+    ata_attached = false;
+    ata_scratch_lba = ATA_NO_SCRATCH;
+    ata_sectors = 0;
+    ata_lba48 = false;
+    ata_multiple = 0;
+    // the next card starts out in PIO 0
+    IDE_set_pio_mode(0);
+    IDE_set_iordy(false);
+    // nothing still queued can be served now.
+    while (ata_queue_counters.depth) {
+        AtaRequest *req = ata_queue_take(0);
+        req->result = ATA_ERR_NO_MEDIA;
+        if (req->done) {
+            req->done(req);
+        }
+    }
+    if (ata_detach_cb) {
+        ata_detach_cb(ata_hotplug_ctx);
+    }
+}
+
+void ata_set_hotplug_callbacks(AtaAttachCallback attach, AtaDetachCallback detach, void *ctx) {
+    ata_attach_cb = attach;
+    ata_detach_cb = detach;
+    ata_hotplug_ctx = ctx;
+}
+
+bool ata_present() {
+    return ata_attached;
+}
+
+// Rough sustained rate of long transfers, from the measured cost of a word plus a per block allowance.
+#define ATA_BLOCK_OVERHEAD_NS 20000 // status read, interrupt and DMA setup per DRQ block
+
+uint32_t ata_estimate_kbps() {
+    uint32_t block = ata_multiple ? ata_multiple : 1;
+    uint32_t sector_ns = ATA_SECTOR_WORDS * ata_ns_per_word + ATA_BLOCK_OVERHEAD_NS / block;
+    return 512000000 / sector_ns;
+}
+
+// One line summary of the card and the transfer setup picked for it.
+static void ata_print_config() {
+    // kept short, the model alone can take 40 of the 120 characters print has.
+    print("ATA %s: %u MB, LBA%u, PIO%u%s, %u ns, x%u, ~%u KB/s\r\n",
+        ata_caps.model, ata_sectors / 2048, ata_lba48 ? 48 : 28, ata_pio_mode, ata_iordy ? "+IORDY" : "",
+        IDE_profile_cycle_ns(ata_profile), ata_multiple, ata_estimate_kbps());
+}
+
+const AtaCapabilities *ata_capabilities() {
+    return ata_attached ? &ata_caps : NULL;
+}
+
+void ata_print_identity() {
+    if (!ata_attached) {
+        print("ATA no card\r\n");
+        return;
+    }
+    print("Drive Model: %s\r\n", ata_caps.model);
+    print("Drive_Serial: %s\r\n", ata_caps.serial);
+    print("Drive Firmware Rev: %s\r\n", ata_caps.firmware);
+    print("Def  C:%u H:%u S:%u -- LBAs: %u, LBA48: %u\r\n", ata_caps.cylinders, ata_caps.heads, ata_caps.sectors_per_track,
+        ata_caps.lba28_sectors, ata_caps.lba48_sectors);
+    print("PIO %u max, %u ns min cycle%s, MULTIPLE %u max, write cache %s, CFA %s\r\n", ata_caps.max_pio, ata_caps.min_pio_cycle,
+        ata_caps.iordy ? " with IORDY" : "", ata_caps.max_multiple,
+        ata_caps.write_cache ? (ata_caps.write_cache_enabled ? "on" : "off") : "none", ata_caps.cfa ? "yes" : "no");
+    print("ATA INTRQ %s\r\n", ata_use_intrq ? "connected" : "not connected, polling");
+    ata_print_config();
+}
+
+void ata_hotplug_service() {
+    static uint32_t last_poll = 0;
+    uint32_t now = HAL_GetTick();
+    // never touch the bus under a request in flight, a card pulled mid request shows up as a timeout first.
+    if (now - last_poll < ATA_HOTPLUG_POLL_MS || ata_busy()) {
+        return;
+    }
+    last_poll = now;
+    if (ata_attached) {
+        if (!ata_card_present()) {
+            print("ATA card removed\r\n");
+            ata_detach();
+        }
+    } else if (ata_card_present()) {
+        if (ata_attach()) {
+            ata_print_config();
+        }
+    }
+}
+
+void ata_init() {
+    IDE_set_intrq_callback(ata_intrq, NULL);
+    // a card that is already powered answers in milliseconds, an empty slot is picked up by ata_hotplug_service.
+    ata_attach();
+}
+
+/**
+ * Loads the task file for a transfer of up to ATA_MAX_SECTORS sectors.
+ * Returns true if the transfer needs the LBA48 EXT commands.
+ */
+static bool ata_task_file(uint32_t address, int count) {
+    bool ext = ata_lba48 && (address + count) > ATA_LBA28_SECTORS;
+    if (ext) {
+        // the previous contents of each register are the high order bytes
+        IDE_write(ATA_REG_SECCOUNT, count >> 8);
+        IDE_write(ATA_REG_LBA3, address >> 24);
+        IDE_write(ATA_REG_LBA4, 0);
+        IDE_write(ATA_REG_LBA5, 0);
+        IDE_write(ATA_REG_SECCOUNT, count & 0xFF);
+        IDE_write(ATA_REG_LBA0, address & 0xFF);
+        IDE_write(ATA_REG_LBA1, (address >> 8) & 0xFF);
+        IDE_write(ATA_REG_LBA2, (address >> 16) & 0xFF);
+        IDE_write(ATA_REG_HDDEVSEL, ATA_MAGIC_SELMASTER | ATA_MAGIC_EN_LBA);
+    } else {
+        IDE_write(ATA_REG_SECCOUNT, count & 0xFF);
+        IDE_write(ATA_REG_LBA0, address & 0xFF);
+        IDE_write(ATA_REG_LBA1, (address >> 8) & 0xFF);
+        IDE_write(ATA_REG_LBA2, (address >> 16) & 0xFF);
+        IDE_write(ATA_REG_HDDEVSEL, ATA_MAGIC_SELMASTER | ATA_MAGIC_EN_LBA | ((address >> 24) & 0x0F));
+    }
+    return ext;
+}
+
+// After a media error the task file holds the first bad sector.
+static uint32_t ata_error_lba(bool ext) {
+    uint32_t lba = (uint8_t)IDE_read(ATA_REG_LBA0) | ((uint8_t)IDE_read(ATA_REG_LBA1) << 8) | ((uint8_t)IDE_read(ATA_REG_LBA2) << 16);
+    if (ext) {
+        // HOB reads back the high order bytes
+        ata_control(ATA_CTL_HOB);
+        lba |= (uint32_t)(uint8_t)IDE_read(ATA_REG_LBA3) << 24;
+        ata_control(0);
+    } else {
+        lba |= (uint32_t)(IDE_read(ATA_REG_HDDEVSEL) & 0x0F) << 24;
+    }
+    return lba;
+}
+
+static bool ata_op_writes(uint8_t op) {
+    return op == ATA_OP_WRITE || op == ATA_OP_WRITE_ERASED;
+}
+
+// Picks the read or write command for the transfer mode and addressing in use.
+static uint8_t ata_transfer_command(uint8_t op, bool ext) {
+    if (op == ATA_OP_VERIFY) {
+        return ext ? ATA_COMMAND_READ_VERIFY_EXT : ATA_COMMAND_READ_VERIFY;
+    }
+    // sectors erased beforehand can skip the erase cycle, only CF cards know how, and only with LBA28.
+    if (op == ATA_OP_WRITE_ERASED && ata_caps.cfa && !ext) {
+        return ata_multiple ? ATA_COMMAND_CFA_WRITE_MULTIPLE_NO_ERASE : ATA_COMMAND_CFA_WRITE_NO_ERASE;
+    }
+    if (op == ATA_OP_READ) {
+        if (ext) {
+            return ata_multiple ? ATA_COMMAND_READ_MULTIPLE_EXT : ATA_COMMAND_READ_SECTOR_EXT;
+        }
+        return ata_multiple ? ATA_COMMAND_READ_MULTIPLE : ATA_COMMAND_READ_SECTOR;
+    }
+    if (ext) {
+        return ata_multiple ? ATA_COMMAND_WRITE_MULTIPLE_EXT : ATA_COMMAND_WRITE_SECTOR_EXT;
+    }
+    return ata_multiple ? ATA_COMMAND_WRITE_MULTIPLE : ATA_COMMAND_WRITE_SECTOR;
+}
+
+/**
+ * Reads up to ATA_MAX_SECTORS sectors with a single command.
+ * The drive raises DRQ (and INTRQ) once per block, a sector or ata_multiple sectors.
+ */
+static uint16_t ata_read_command(uint32_t address, uint16_t *data, int count) {
+    uint16_t err = ata_ready();
     if (err) {
         return err;
     }
+    int block = ata_multiple ? ata_multiple : 1;
+    ata_command(ata_transfer_command(ATA_OP_READ, ata_task_file(address, count)));
 
-    ata_read_buffer((uint16_t *)data, 256);
+    while (count > 0) {
+        err = ata_poll_intrq();
+        if (err) {
+            return err;
+        }
+        int sectors = count < block ? count : block;
+        // the status read acknowledged this block, the next one can interrupt as soon as it's read out.
+        ata_irq_pending = false;
+        ata_read_buffer(data, sectors * ATA_SECTOR_WORDS);
+        data += sectors * ATA_SECTOR_WORDS;
+        count -= sectors;
+    }
     return 0;
 }
-    
-uint16_t ata_write_disk(uint16_t address, uint8_t *data, int count) {
-    // spin while card is busy
-    HAL_Delay(1);
-    uint16_t err = ata_poll();
+
+/**
+ * Writes up to ATA_MAX_SECTORS sectors with a single command.
+ * The first block is requested without an interrupt, every later one and the
+ * completion of the command come with one.
+ */
+static uint16_t ata_write_command(uint8_t op, uint32_t address, uint16_t *data, int count) {
+    uint16_t err = ata_ready();
     if (err) {
-	return err;
+        return err;
     }
-    
-    IDE_write(ATA_REG_SECCOUNT, 1);
-    IDE_write(ATA_REG_LBA0, address & 0xFF);
-    IDE_write(ATA_REG_LBA1, address >> 8);
-    IDE_write(ATA_REG_LBA2, 0);
-    IDE_write(ATA_REG_HDDEVSEL, 0xE0);
-    IDE_write(ATA_REG_COMMAND, ATA_COMMAND_WRITE_SECTOR);
+    int block = ata_multiple ? ata_multiple : 1;
+    ata_command(ata_transfer_command(op, ata_task_file(address, count)));
 
     err = ata_poll();
-    if (err) {
-        return err;
+    while (!err) {
+        int sectors = count < block ? count : block;
+        ata_irq_pending = false;
+        ata_write_buffer(data, sectors * ATA_SECTOR_WORDS);
+        data += sectors * ATA_SECTOR_WORDS;
+        count -= sectors;
+        if (count == 0) {
+            // wait for the last block to hit the media
+            return ata_wait();
+        }
+        err = ata_poll_intrq();
+    }
+    return err;
+}
+
+uint16_t ata_read_disk(uint32_t address, uint8_t *data, int count) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (count < 0 || address >= ata_sectors || count > ata_sectors - address) {
+        return ATA_ERR_RANGE;
+    }
+    while (count > 0) {
+        int sectors = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        uint16_t err;
+        int attempt = 0;
+        do {
+            err = ata_read_command(address, (uint16_t *)data, sectors);
+        } while (err && ata_retry(err, attempt++));
+        if (err) {
+            return err;
+        }
+        address += sectors;
+        data += sectors * 512;
+        count -= sectors;
+    }
+    return 0;
+}
+
+static uint16_t ata_write_op(uint8_t op, uint32_t address, uint8_t *data, int count) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (count < 0 || address >= ata_sectors || count > ata_sectors - address) {
+        return ATA_ERR_RANGE;
+    }
+    while (count > 0) {
+        int sectors = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        uint16_t err;
+        int attempt = 0;
+        do {
+            err = ata_write_command(op, address, (uint16_t *)data, sectors);
+        } while (err && ata_retry(err, attempt++));
+        if (err) {
+            return err;
+        }
+        address += sectors;
+        data += sectors * 512;
+        count -= sectors;
+    }
+    return 0;
+}
+
+uint16_t ata_write_disk(uint32_t address, uint8_t *data, int count) {
+    return ata_write_op(ATA_OP_WRITE, address, data, count);
+}
+
+/**
+ * Writes sectors that were erased with ata_erase_disk, without erasing them again.
+ * Falls back to a normal write on cards without the CFA feature set and past LBA28.
+ */
+uint16_t ata_write_erased(uint32_t address, uint8_t *data, int count) {
+    return ata_write_op(ATA_OP_WRITE_ERASED, address, data, count);
+}
+
+/**
+ * Pre-erases sectors with CFA ERASE SECTORS, so they can later be written with ata_write_erased.
+ * Only CF cards support it, and only within LBA28.
+ */
+uint16_t ata_erase_disk(uint32_t address, int count) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (!ata_caps.cfa) {
+        return ATA_ERR_UNSUPPORTED;
+    }
+    if (count < 0 || address >= ata_sectors || count > ata_sectors - address || address + count > ATA_LBA28_SECTORS) {
+        return ATA_ERR_RANGE;
+    }
+    while (count > 0) {
+        int sectors = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        uint16_t err = ata_ready();
+        if (err) {
+            return err;
+        }
+        ata_task_file(address, sectors);
+        ata_command(ATA_COMMAND_CFA_ERASE);
+        err = ata_wait_for(ATA_ERASE_TIMEOUT_MS);
+        if (err) {
+            return err;
+        }
+        address += sectors;
+        count -= sectors;
+    }
+    return 0;
+}
+
+/**
+ * Has the drive check count sectors against their ECC with READ VERIFY, nothing crosses the bus.
+ * On a media error the first bad sector is stored in bad_lba, if given.
+ */
+uint16_t ata_verify_disk(uint32_t address, int count, uint32_t *bad_lba) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (count < 0 || address >= ata_sectors || count > ata_sectors - address) {
+        return ATA_ERR_RANGE;
+    }
+    while (count > 0) {
+        int sectors = count < ATA_MAX_SECTORS ? count : ATA_MAX_SECTORS;
+        uint16_t err = ata_ready();
+        if (err) {
+            return err;
+        }
+        bool ext = ata_task_file(address, sectors);
+        ata_command(ata_transfer_command(ATA_OP_VERIFY, ext));
+        err = ata_wait();
+        if (err) {
+            if (ATA_ERR_FROM_DRIVE(err) && bad_lba) {
+                *bad_lba = ata_error_lba(ext);
+            }
+            return err;
+        }
+        address += sectors;
+        count -= sectors;
+    }
+    return 0;
+}
+
+bool ata_busy() {
+    return ata_state != ATA_STATE_IDLE;
+}
+
+uint32_t ata_service_worst_ns() {
+    return STOPWATCH_TICKS_TO_NS(ata_worst_ticks);
+}
+
+static void ata_async_sector();
+
+// DMA completion, runs in interrupt context. Chains the sectors of a multiple block together.
+static void ata_async_dma_done(void *ctx) {
+    ata_xfer_data += ATA_SECTOR_WORDS * 2;
+    // merged requests each bring their own buffer
+    if (--ata_seg_left == 0 && ata_seg->chain) {
+        ata_seg = ata_seg->chain;
+        ata_xfer_data = ata_seg->data;
+        ata_seg_left = ata_seg->count;
+    }
+    if (--ata_xfer_left > 0) {
+        ata_async_sector();
+    }
+}
+
+static void ata_async_sector() {
+    if (ata_req->op == ATA_OP_READ) {
+        IDE_dma_read(ATA_REG_DATA, (uint16_t *)ata_xfer_data, ATA_SECTOR_WORDS, ata_async_dma_done, NULL);
+    } else {
+        IDE_dma_write(ATA_REG_DATA, (const uint16_t *)ata_xfer_data, ATA_SECTOR_WORDS, ata_async_dma_done, NULL);
+    }
+}
+
+static void ata_async_enter(AtaState state, bool expect_irq) {
+    ata_state = state;
+    ata_expect_irq = expect_irq && ata_use_intrq;
+    ata_deadline = HAL_GetTick() + ATA_TIMEOUT_MS;
+}
+
+static void ata_async_finish(uint16_t result) {
+    AtaRequest *req = ata_req;
+    if (result && ata_retryable(result) && ata_req_attempts < ATA_RETRIES) {
+        // the whole chain goes again once the backoff is over, repeating sectors that already
+        // made it is harmless. A reset blocks, but only after a drive that already stalled.
+        ata_recover(result);
+        ata_state = ATA_STATE_BACKOFF;
+        ata_expect_irq = false;
+        ata_deadline = HAL_GetTick() + ata_backoff_ms(ata_req_attempts++);
+        return;
+    }
+    ata_state = ATA_STATE_IDLE;
+    ata_req = NULL;
+    uint32_t error_lba = 0;
+    if (ATA_ERR_FROM_DRIVE(result)) {
+        error_lba = ata_error_lba(ata_cmd_ext);
+    }
+    // every request of a merged chain shares the result, the callbacks are free to submit more.
+    while (req) {
+        AtaRequest *next = req->chain;
+        req->result = result;
+        req->error_lba = error_lba;
+        if (req->done) {
+            req->done(req);
+        }
+        req = next;
+    }
+}
+
+static bool ata_in_range(uint32_t lba, int count) {
+    return count >= 0 && lba < ata_sectors && count <= ata_sectors - lba;
+}
+
+// Starts a chain of requests covering consecutive sectors with the same op.
+static void ata_async_start(AtaRequest *head) {
+    int count = 0;
+    for (AtaRequest *req = head; req; req = req->chain) {
+        req->result = 0;
+        count += req->count;
     }
+    ata_req = head;
+    ata_req_lba = head->lba;
+    ata_req_left = count;
+    ata_seg = head;
+    ata_seg_left = head->count;
+    ata_xfer_data = head->data;
+    ata_async_enter(ATA_STATE_READY, false);
+}
 
-    ata_write_buffer((uint16_t *)data, 256);
+uint16_t ata_submit(AtaRequest *req) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (ata_busy()) {
+        return ATA_ERR_BUSY;
+    }
+    if (req->op == ATA_OP_FLUSH) {
+        req->count = 0;
+    } else if (!ata_in_range(req->lba, req->count)) {
+        return ATA_ERR_RANGE;
+    }
+    req->chain = NULL;
+    ata_req_attempts = 0;
+    ata_async_start(req);
     return 0;
 }
+
+static bool ata_overlaps(const AtaRequest *a, const AtaRequest *b) {
+    return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+/**
+ * A request can't go ahead of an older one touching the same sectors if either of them writes.
+ * A flush is a barrier, writes don't pass it either way.
+ */
+static bool ata_queue_blocked(int i) {
+    for (int j = 0; j < i; j++) {
+        AtaRequest *older = ata_queue_slots[j];
+        uint8_t op = ata_queue_slots[i]->op;
+        if ((older->op == ATA_OP_FLUSH && ata_op_writes(op)) || (ata_op_writes(older->op) && op == ATA_OP_FLUSH)) {
+            return true;
+        }
+        if ((ata_op_writes(older->op) || ata_op_writes(op)) && ata_overlaps(older, ata_queue_slots[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static AtaRequest *ata_queue_take(int i) {
+    AtaRequest *req = ata_queue_slots[i];
+    // shift down to keep the slots in arrival order, ties on deadline go first come first served.
+    for (int j = i + 1; j < ata_queue_counters.depth; j++) {
+        ata_queue_slots[j - 1] = ata_queue_slots[j];
+    }
+    ata_queue_counters.depth--;
+    return req;
+}
+
+/**
+ * Starts the queued request with the earliest deadline, along with every other queued
+ * request of the same op that extends it into a run of consecutive sectors.
+ */
+static void ata_queue_dispatch() {
+    int first = -1;
+    for (int i = 0; i < ata_queue_counters.depth; i++) {
+        if (ata_queue_blocked(i)) {
+            continue;
+        }
+        if (first < 0 || (int32_t)(ata_queue_slots[i]->deadline - ata_queue_slots[first]->deadline) < 0) {
+            first = i;
+        }
+    }
+    if (first < 0) {
+        return;
+    }
+    AtaRequest *head = ata_queue_take(first);
+    AtaRequest *tail = head;
+    head->chain = NULL;
+    uint32_t start = head->lba;
+    uint32_t end = head->lba + head->count;
+
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (int i = 0; i < ata_queue_counters.depth; i++) {
+            AtaRequest *req = ata_queue_slots[i];
+            if (req->op != head->op || end - start + req->count > ATA_QUEUE_MERGE_MAX || ata_queue_blocked(i)) {
+                continue;
+            }
+            if (req->lba == end) {
+                ata_queue_take(i);
+                req->chain = NULL;
+                tail->chain = req;
+                tail = req;
+                end += req->count;
+            } else if (req->lba + req->count == start) {
+                ata_queue_take(i);
+                req->chain = head;
+                head = req;
+                start = req->lba;
+            } else {
+                continue;
+            }
+            ata_queue_counters.merged++;
+            merged = true;
+            break;
+        }
+    }
+    ata_queue_counters.commands++;
+    ata_req_attempts = 0;
+    ata_async_start(head);
+}
+
+uint16_t ata_queue(AtaRequest *req) {
+    if (!ata_attached) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (req->op == ATA_OP_FLUSH) {
+        req->count = 0;
+    } else if (req->count < 1 || !ata_in_range(req->lba, req->count)) {
+        return ATA_ERR_RANGE;
+    }
+    if (ata_queue_counters.depth == ATA_QUEUE_SIZE) {
+        return ATA_ERR_BUSY;
+    }
+    ata_queue_slots[ata_queue_counters.depth++] = req;
+    ata_queue_counters.queued++;
+    if (ata_queue_counters.depth > ata_queue_counters.max_depth) {
+        ata_queue_counters.max_depth = ata_queue_counters.depth;
+    }
+    return 0;
+}
+
+uint16_t ata_cancel(AtaRequest *req) {
+    for (int i = 0; i < ata_queue_counters.depth; i++) {
+        if (ata_queue_slots[i] == req) {
+            ata_queue_take(i);
+            return 0;
+        }
+    }
+    // already on the bus, it has to run its course.
+    return ATA_ERR_BUSY;
+}
+
+const AtaQueueStats *ata_queue_stats() {
+    return &ata_queue_counters;
+}
+
+// One step of the request state machine, at most a status read and a task file or a DMA start.
+static void ata_async_step() {
+    if (ata_state == ATA_STATE_IDLE) {
+        ata_queue_dispatch();
+        return;
+    }
+    if (ata_state == ATA_STATE_BACKOFF) {
+        if ((int32_t)(HAL_GetTick() - ata_deadline) >= 0) {
+            ata_async_start(ata_req);
+        }
+        return;
+    }
+    if (ata_state == ATA_STATE_TRANSFER) {
+        if (ata_xfer_left > 0 || IDE_dma_busy()) {
+            return;
+        }
+        if (ata_cmd_left > 0) {
+            ata_async_enter(ATA_STATE_DRQ, true);
+        } else if (ata_op_writes(ata_req->op)) {
+            ata_async_enter(ATA_STATE_COMPLETE, true);
+        } else if (ata_req_left > 0) {
+            ata_async_enter(ATA_STATE_READY, false);
+        } else {
+            ata_async_finish(0);
+        }
+        return;
+    }
+
+    // don't touch the bus until the drive says it has something for us.
+    if (ata_expect_irq && !ata_irq_pending) {
+        if ((int32_t)(HAL_GetTick() - ata_deadline) > 0) {
+            ata_async_finish(ATA_ERR_TIMEOUT);
+        }
+        return;
+    }
+    if (IDE_read(ATA_REG_ALTSTATUS) & ATA_SR_BSY) {
+        if ((int32_t)(HAL_GetTick() - ata_deadline) > 0) {
+            ata_async_finish(ATA_ERR_TIMEOUT);
+        }
+        return;
+    }
+    uint16_t status = (uint8_t)IDE_read(ATA_REG_STATUS);
+    uint16_t err = ata_status_error(status);
+    if (err) {
+        ata_async_finish(err);
+        return;
+    }
+
+    switch (ata_state) {
+        case ATA_STATE_READY: {
+            if (ata_req->op == ATA_OP_FLUSH) {
+                if (!ata_caps.write_cache) {
+                    ata_async_finish(0);
+                    return;
+                }
+                ata_command(ata_flush_command());
+                ata_async_enter(ATA_STATE_COMPLETE, true);
+                ata_deadline = HAL_GetTick() + ATA_FLUSH_TIMEOUT_MS;
+                break;
+            }
+            int sectors = ata_req_left < ATA_MAX_SECTORS ? ata_req_left : ATA_MAX_SECTORS;
+            if (sectors == 0) {
+                ata_async_finish(0);
+                return;
+            }
+            ata_cmd_ext = ata_task_file(ata_req_lba, sectors);
+            ata_command(ata_transfer_command(ata_req->op, ata_cmd_ext));
+            ata_req_lba += sectors;
+            ata_req_left -= sectors;
+            if (ata_req->op == ATA_OP_VERIFY) {
+                // no data phase, just wait for the drive to finish checking.
+                ata_cmd_left = 0;
+                ata_async_enter(ATA_STATE_COMPLETE, true);
+                break;
+            }
+            ata_cmd_left = sectors;
+            // the first block of a write is requested without an interrupt.
+            ata_async_enter(ATA_STATE_DRQ, ata_req->op == ATA_OP_READ);
+            break;
+        }
+        case ATA_STATE_DRQ: {
+            if (!(status & ATA_SR_DRQ)) {
+                // unknown error;
+                ata_async_finish(0xFFFF);
+                return;
+            }
+            int block = ata_multiple ? ata_multiple : 1;
+            ata_xfer_left = ata_cmd_left < block ? ata_cmd_left : block;
+            ata_cmd_left -= ata_xfer_left;
+            // the status read acknowledged this block, the next one can interrupt as soon as it's moved.
+            ata_irq_pending = false;
+            ata_state = ATA_STATE_TRANSFER;
+            ata_async_sector();
+            break;
+        }
+        case ATA_STATE_COMPLETE:
+            if (ata_req_left > 0) {
+                ata_async_enter(ATA_STATE_READY, false);
+            } else {
+                ata_async_finish(0);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Pumps the asynchronous request in flight, or starts the next queued one. Every call does a bounded
+ * amount of bus work and returns, the time it took is tracked so the worst case can be checked against the sample rate.
+ */
+void ata_service() {
+    Stopwatch_t sw;
+    STOPWATCH_START(sw);
+    ata_async_step();
+    STOPWATCH_STOP(sw);
+    uint32_t ticks = STOPWATCH_READ_TICKS(sw);
+    if (ticks > ata_worst_ticks) {
+        ata_worst_ticks = ticks;
+    }
+}
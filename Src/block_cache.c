@@ -0,0 +1,201 @@
+#include "block_cache.h"
+
+#include "ata_driver.h"
+#include "print.h"
+
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+typedef struct {
+    uint8_t data[512];      // first, so the DMA engine gets it halfword aligned
+    uint32_t lba;
+    uint32_t used;          // LRU stamp, bigger is more recent
+    uint32_t dirty_since;   // HAL tick of the first change since the last write back
+    bool valid;
+    bool dirty;
+    volatile bool writing;  // queued for write back, can't be evicted until it lands
+    AtaRequest req;
+} CacheSlot;
+
+static CacheSlot slots[BLOCK_CACHE_SLOTS];
+static uint32_t use_clock = 0;
+
+static uint32_t hits = 0;
+static uint32_t misses = 0;
+static uint32_t writebacks = 0;
+static uint32_t write_errors = 0;
+
+// The blocking ATA calls refuse to run while a queued request is in flight, wait it out.
+static void block_cache_wait_idle() {
+    while (ata_busy()) {
+        ata_service();
+    }
+}
+
+static void block_cache_wait_slot(CacheSlot *slot) {
+    while (slot->writing) {
+        ata_service();
+    }
+}
+
+static uint16_t block_cache_write_slot(CacheSlot *slot) {
+    block_cache_wait_slot(slot);
+    block_cache_wait_idle();
+    uint16_t err = ata_write_disk(slot->lba, slot->data, 1);
+    if (err) {
+        write_errors++;
+        return err;
+    }
+    slot->dirty = false;
+    writebacks++;
+    return 0;
+}
+
+static CacheSlot *block_cache_find(uint32_t lba) {
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        if (slots[i].valid && slots[i].lba == lba) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+// Picks a free slot, or the least recently used one, writing it back first if it is dirty.
+static CacheSlot *block_cache_evict() {
+    CacheSlot *victim = NULL;
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        if (!slots[i].valid) {
+            return &slots[i];
+        }
+        if (!victim || slots[i].used < victim->used) {
+            victim = &slots[i];
+        }
+    }
+    if (victim->dirty && block_cache_write_slot(victim)) {
+        return NULL;
+    }
+    block_cache_wait_slot(victim);
+    victim->valid = false;
+    return victim;
+}
+
+static uint8_t *block_cache_lookup(uint32_t lba, bool fill) {
+    CacheSlot *slot = block_cache_find(lba);
+    if (slot) {
+        hits++;
+    } else {
+        misses++;
+        slot = block_cache_evict();
+        if (!slot) {
+            return NULL;
+        }
+        if (fill) {
+            block_cache_wait_idle();
+            if (ata_read_disk(lba, slot->data, 1)) {
+                return NULL;
+            }
+        } else {
+            memset(slot->data, 0, sizeof(slot->data));
+        }
+        slot->lba = lba;
+        slot->valid = true;
+        slot->dirty = false;
+    }
+    slot->used = ++use_clock;
+    return slot->data;
+}
+
+uint8_t *block_cache_get(uint32_t lba) {
+    return block_cache_lookup(lba, true);
+}
+
+uint8_t *block_cache_get_blank(uint32_t lba) {
+    CacheSlot *slot = block_cache_find(lba);
+    uint8_t *data = block_cache_lookup(lba, false);
+    // a hit still has the old contents, the caller asked for a clean sheet.
+    if (slot && data) {
+        block_cache_wait_slot(slot);
+        memset(data, 0, 512);
+    }
+    return data;
+}
+
+void block_cache_dirty(uint32_t lba) {
+    CacheSlot *slot = block_cache_find(lba);
+    if (slot && !slot->dirty) {
+        slot->dirty = true;
+        slot->dirty_since = HAL_GetTick();
+    }
+}
+
+uint16_t block_cache_flush() {
+    uint16_t result = 0;
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        if (slots[i].valid && slots[i].dirty) {
+            uint16_t err = block_cache_write_slot(&slots[i]);
+            if (err && !result) {
+                result = err;
+            }
+        }
+        block_cache_wait_slot(&slots[i]);
+    }
+    // the sectors are only safe once they are out of the drive's write cache too.
+    block_cache_wait_idle();
+    uint16_t err = ata_flush_cache();
+    return result ? result : err;
+}
+
+static void block_cache_written(AtaRequest *req) {
+    CacheSlot *slot = (CacheSlot *)req->ctx;
+    if (req->result) {
+        // try again on the next round
+        write_errors++;
+        if (!slot->dirty) {
+            slot->dirty = true;
+            slot->dirty_since = HAL_GetTick();
+        }
+    } else {
+        writebacks++;
+    }
+    slot->writing = false;
+}
+
+void block_cache_service() {
+    uint32_t now = HAL_GetTick();
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        CacheSlot *slot = &slots[i];
+        if (!slot->valid || !slot->dirty || slot->writing || now - slot->dirty_since < BLOCK_CACHE_WRITEBACK_MS) {
+            continue;
+        }
+        slot->req.op = ATA_OP_WRITE;
+        slot->req.lba = slot->lba;
+        slot->req.data = slot->data;
+        slot->req.count = 1;
+        slot->req.done = block_cache_written;
+        slot->req.ctx = slot;
+        // metadata is never urgent, let the audio streams go first.
+        slot->req.deadline = now + BLOCK_CACHE_WRITEBACK_MS;
+        if (ata_queue(&slot->req)) {
+            // queue is full, the next call will try again.
+            return;
+        }
+        // changes made from here on dirty it again.
+        slot->dirty = false;
+        slot->writing = true;
+    }
+}
+
+void block_cache_invalidate() {
+    for (int i = 0; i < BLOCK_CACHE_SLOTS; i++) {
+        block_cache_wait_slot(&slots[i]);
+        slots[i].valid = false;
+        slots[i].dirty = false;
+    }
+}
+
+void block_cache_print_stats() {
+    uint32_t lookups = hits + misses;
+    print("Block cache: %u hits, %u misses (%u%% hit), %u writebacks, %u write errors\r\n",
+        hits, misses, lookups ? (hits * 100) / lookups : 0, writebacks, write_errors);
+}
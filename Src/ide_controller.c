@@ -4,26 +4,172 @@
 
 #include "stm32f1xx_hal.h"
 
-#define IDE_SPEED GPIO_SPEED_LOW
+#define IDE_SPEED GPIO_SPEED_MEDIUM // matches the 10MHz data port, low speed edges are too slow for PIO 3/4
 #define IDE_PORT_READ 0x88888888
 #define IDE_PORT_WRITE 0x11111111
 #define IDE_ODR_READ 0x0000
 
-#define NS_ADDR_SETUP 70
-#define NS_DATA_SETUP 165
-#define NS_WRITE_SETUP 60
-#define NS_WRITE_HOLD 30
-#define NS_READ_HOLD 20
+// PIO timings in ns, from the ATA-4 PIO timing table (16-bit data register cycles).
+typedef struct {
+    uint16_t cycle;      // t0  minimum cycle time
+    uint16_t addr_setup; // t1  address valid to DIOR/DIOW setup
+    uint16_t data_setup; // t2  DIOR/DIOW pulse width
+    uint16_t recovery;   // t2i DIOR/DIOW recovery time
+    uint16_t write_setup;// t3  DIOW data setup
+    uint16_t write_hold; // t4  DIOW data hold
+    uint16_t read_hold;  // t9  DIOR/DIOW to address valid hold
+} PioTiming;
+
+// The polled bus cycles for one PIO mode, see ide_pio_kernels.h
+typedef struct {
+    const PioTiming *timing;
+    uint16_t (*read)(uint8_t reg);
+    void (*write)(uint8_t reg, uint16_t value);
+    void (*read_burst)(uint8_t reg, uint16_t *dst, int n);
+    void (*write_burst)(uint8_t reg, const uint16_t *src, int n);
+} PioKernels;
+
+static void IDE_dma_init();
+
+// the longest a drive is allowed to hold IORDY low (tB)
+#define IDE_IORDY_TIMEOUT_NS 1250
+
+static bool iordy_enabled;
+
+// chip select BSRR patterns, both selects are active low.
+#define IDE_CS_COMMAND ((0x01 << (IDE_CS0_PIN + 16)) | (0x01 << IDE_CS1_PIN))
+#define IDE_CS_CONTROL ((0x01 << IDE_CS0_PIN) | (0x01 << (IDE_CS1_PIN + 16)))
+
+static inline void IDE_set_addr(uint8_t addr) {
+    // We're gonna drive the Port nanually, cos the HAL uses if statements, and I don't like that.
+    IDE_CS_PORT->BSRR = (addr & IDE_REG_CONTROL_BLOCK) ? IDE_CS_CONTROL : IDE_CS_COMMAND;
+    addr &= 0x7;
+    //generate a mask of reset pins by inverting the set pins
+    uint8_t naddr = (~addr) & 0x7;
+    // create a 32 bit register of pins to set and pins to reset (naddr)
+    uint32_t bsrr = (addr << IDE_ADDRESS_OFFSET) | (naddr << (IDE_ADDRESS_OFFSET + 16));
+    IDE_ADDRESS_PORT->BSRR = bsrr; //blit it to the port
+}
+
+// Instantiate the bus cycle kernels for each PIO mode, the timings are in ns.
+#define PIO_CAT(A, B) A##B
+#define PIO_NAME(NAME, MODE) PIO_CAT(NAME, MODE)
+
+#define PIO_MODE 0
+#define PIO_CYCLE 600
+#define PIO_ADDR_SETUP 70
+#define PIO_DATA_SETUP 165
+#define PIO_RECOVERY 0
+#define PIO_WRITE_SETUP 60
+#define PIO_WRITE_HOLD 30
+#define PIO_READ_HOLD 20
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 1
+#define PIO_CYCLE 383
+#define PIO_ADDR_SETUP 50
+#define PIO_DATA_SETUP 125
+#define PIO_RECOVERY 0
+#define PIO_WRITE_SETUP 45
+#define PIO_WRITE_HOLD 20
+#define PIO_READ_HOLD 15
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 2
+#define PIO_CYCLE 240
+#define PIO_ADDR_SETUP 30
+#define PIO_DATA_SETUP 100
+#define PIO_RECOVERY 0
+#define PIO_WRITE_SETUP 30
+#define PIO_WRITE_HOLD 15
+#define PIO_READ_HOLD 10
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 3
+#define PIO_CYCLE 180
+#define PIO_ADDR_SETUP 30
+#define PIO_DATA_SETUP 80
+#define PIO_RECOVERY 70
+#define PIO_WRITE_SETUP 30
+#define PIO_WRITE_HOLD 10
+#define PIO_READ_HOLD 10
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 4
+#define PIO_CYCLE 120
+#define PIO_ADDR_SETUP 25
+#define PIO_DATA_SETUP 70
+#define PIO_RECOVERY 25
+#define PIO_WRITE_SETUP 20
+#define PIO_WRITE_HOLD 10
+#define PIO_READ_HOLD 10
+#include "ide_pio_kernels.h"
+
+// Tuned profiles, PIO 4 with every delay cut down by an eighth per step. These are out of
+// spec, and only selected once ata_calibrate has checked the attached card at them.
+#define PIO_TUNED(NS, STEP) ((NS) * (8 - (STEP)) / 8)
+
+#define PIO_MODE 5
+#define PIO_CYCLE PIO_TUNED(120, 1)
+#define PIO_ADDR_SETUP PIO_TUNED(25, 1)
+#define PIO_DATA_SETUP PIO_TUNED(70, 1)
+#define PIO_RECOVERY PIO_TUNED(25, 1)
+#define PIO_WRITE_SETUP PIO_TUNED(20, 1)
+#define PIO_WRITE_HOLD PIO_TUNED(10, 1)
+#define PIO_READ_HOLD PIO_TUNED(10, 1)
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 6
+#define PIO_CYCLE PIO_TUNED(120, 2)
+#define PIO_ADDR_SETUP PIO_TUNED(25, 2)
+#define PIO_DATA_SETUP PIO_TUNED(70, 2)
+#define PIO_RECOVERY PIO_TUNED(25, 2)
+#define PIO_WRITE_SETUP PIO_TUNED(20, 2)
+#define PIO_WRITE_HOLD PIO_TUNED(10, 2)
+#define PIO_READ_HOLD PIO_TUNED(10, 2)
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 7
+#define PIO_CYCLE PIO_TUNED(120, 3)
+#define PIO_ADDR_SETUP PIO_TUNED(25, 3)
+#define PIO_DATA_SETUP PIO_TUNED(70, 3)
+#define PIO_RECOVERY PIO_TUNED(25, 3)
+#define PIO_WRITE_SETUP PIO_TUNED(20, 3)
+#define PIO_WRITE_HOLD PIO_TUNED(10, 3)
+#define PIO_READ_HOLD PIO_TUNED(10, 3)
+#include "ide_pio_kernels.h"
+
+#define PIO_MODE 8
+#define PIO_CYCLE PIO_TUNED(120, 4)
+#define PIO_ADDR_SETUP PIO_TUNED(25, 4)
+#define PIO_DATA_SETUP PIO_TUNED(70, 4)
+#define PIO_RECOVERY PIO_TUNED(25, 4)
+#define PIO_WRITE_SETUP PIO_TUNED(20, 4)
+#define PIO_WRITE_HOLD PIO_TUNED(10, 4)
+#define PIO_READ_HOLD PIO_TUNED(10, 4)
+#include "ide_pio_kernels.h"
+
+static const PioKernels *const pio_kernels[IDE_PROFILES] = {
+    &pio_kernels_0, &pio_kernels_1, &pio_kernels_2, &pio_kernels_3, &pio_kernels_4,
+    &pio_kernels_5, &pio_kernels_6, &pio_kernels_7, &pio_kernels_8,
+};
+
+static const PioKernels *kernels = &pio_kernels_0;
+static uint8_t profile;
+
+static IDE_Callback intrq_callback;
+static void *intrq_ctx;
 
 void IDE_init() {
     GPIO_InitTypeDef GPIO_InitStruct = {0};
-    // Configure CS0 
-    HAL_GPIO_WritePin(GPIOC, GPIO_PIN_8, GPIO_PIN_RESET);
-    GPIO_InitStruct.Pin = GPIO_PIN_8;
+    // Configure CS0 and CS1, the command block is selected by default
+    HAL_GPIO_WritePin(IDE_CS_PORT, (0x01 << IDE_CS0_PIN), GPIO_PIN_RESET);
+    HAL_GPIO_WritePin(IDE_CS_PORT, (0x01 << IDE_CS1_PIN), GPIO_PIN_SET);
+    GPIO_InitStruct.Pin = (0x01 << IDE_CS0_PIN) | (0x01 << IDE_CS1_PIN);
     GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
     GPIO_InitStruct.Speed = IDE_SPEED;
-    HAL_GPIO_Init(GPIOC, &GPIO_InitStruct); 
+    HAL_GPIO_Init(IDE_CS_PORT, &GPIO_InitStruct); 
     
     // Configure Read Strobe
     HAL_GPIO_WritePin(IDE_READ_STROBE_PORT, (0x01 << IDE_READ_STROBE_PIN), GPIO_PIN_SET);
@@ -49,6 +195,20 @@ void IDE_init() {
     GPIO_InitStruct.Speed = IDE_SPEED;
     HAL_GPIO_Init(IDE_ADDRESS_PORT, &GPIO_InitStruct);
 
+    // Configure IORDY
+    GPIO_InitStruct.Pin = (0x01 << IDE_IORDY_PIN);
+    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+    GPIO_InitStruct.Pull = GPIO_PULLUP;
+    HAL_GPIO_Init(IDE_IORDY_PORT, &GPIO_InitStruct);
+
+    // Configure INTRQ, pulled down so a drive without it wired never fires
+    GPIO_InitStruct.Pin = (0x01 << IDE_INTRQ_PIN);
+    GPIO_InitStruct.Mode = GPIO_MODE_IT_RISING;
+    GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+    HAL_GPIO_Init(IDE_INTRQ_PORT, &GPIO_InitStruct);
+    HAL_NVIC_SetPriority(EXTI9_5_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+
     // Configure Data Bus
     // Reset Data Port into read mode (We will be using it bidirectionally as the Data bus.);
     IDE_DATA_PORT->ODR = IDE_ODR_READ;
@@ -57,16 +217,55 @@ void IDE_init() {
 
     // this peripheral uses the stopwatch timer, so we need to start it
     STOPWATCH_RESET();
+    // the bus timing was worked out at compile time for this clock.
+    assert_param(HAL_RCC_GetSysClockFreq() == CLK_SPEED);
+
+    // every device has to accept mode 0 until told otherwise.
+    IDE_set_pio_mode(0);
+
+    IDE_dma_init();
 }
 
-inline void IDE_set_addr(uint8_t addr) {
-    // We're gonna drive the Port nanually, cos the HAL uses if statements, and I don't like that.
-    addr &= 0x7;
-    //generate a mask of reset pins by inverting the set pins
-    uint8_t naddr = (~addr) & 0x7;
-    // create a 32 bit register of pins to set and pins to reset (naddr)
-    uint32_t bsrr = (addr << IDE_ADDRESS_OFFSET) | (naddr << (IDE_ADDRESS_OFFSET + 16));
-    IDE_ADDRESS_PORT->BSRR = bsrr; //blit it to the port
+bool IDE_set_pio_mode(uint8_t mode) {
+    if (mode >= IDE_PIO_MODES) {
+        return false;
+    }
+    return IDE_set_profile(mode);
+}
+
+uint8_t IDE_get_pio_mode() {
+    return profile < IDE_PIO_MODES ? profile : IDE_PIO_MODES - 1;
+}
+
+uint16_t IDE_pio_cycle_ns(uint8_t mode) {
+    if (mode >= IDE_PIO_MODES) {
+        return 0;
+    }
+    return IDE_profile_cycle_ns(mode);
+}
+
+bool IDE_set_profile(uint8_t p) {
+    if (p >= IDE_PROFILES) {
+        return false;
+    }
+    kernels = pio_kernels[p];
+    profile = p;
+    return true;
+}
+
+uint8_t IDE_get_profile() {
+    return profile;
+}
+
+uint16_t IDE_profile_cycle_ns(uint8_t p) {
+    if (p >= IDE_PROFILES) {
+        return 0;
+    }
+    return pio_kernels[p]->timing->cycle;
+}
+
+void IDE_set_iordy(bool enabled) {
+    iordy_enabled = enabled;
 }
 
 /**
@@ -74,56 +273,275 @@ inline void IDE_set_addr(uint8_t addr) {
  * This is very blocking
  */
 uint16_t IDE_read(uint8_t reg) {
-    IDE_set_addr(reg);
-    //Address setup time;
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_DATA_SETUP));
-    //set port to read
-    IDE_DATA_PORT->ODR = IDE_ODR_READ;
-    IDE_DATA_PORT->CRL = IDE_PORT_READ;
-    IDE_DATA_PORT->CRH = IDE_PORT_READ;
-    // get data
-    // Set strobe pin
-    IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN + 16));
-    //data setup time
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_DATA_SETUP));
-    // read input data into destination
-    uint16_t result = IDE_DATA_PORT->IDR;
-    //clear strobe pin
-    IDE_READ_STROBE_PORT->BSRR = (0x01 << (IDE_READ_STROBE_PIN));
-    // recovery time
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_READ_HOLD));
-    return result;
+    return kernels->read(reg);
 }
 
-
 /** 
  * this will write/read from/to a register on the IDE bus
- * Timings are assuming mode0 and are stolen from http://blog.retroleum.co.uk/electronics-articles/an-8-bit-ide-interface/
+ * Timings are taken from the currently selected PIO mode, see IDE_set_pio_mode
  */
 void IDE_write(uint8_t reg, uint16_t value) {
+    kernels->write(reg, value);
+}
+
+/**
+ * Reads n words from a single register in one burst.
+ * The address is latched and the data port set to input once, after that
+ * only the read strobe is toggled per word.
+ */
+void IDE_read_burst(uint8_t reg, uint16_t *dst, int n) {
+    kernels->read_burst(reg, dst, n);
+}
+
+/**
+ * Writes n words to a single register in one burst.
+ * The address is latched and the data port driven once, after that only
+ * the write strobe is toggled per word. The port is released back to read
+ * mode at the end of the burst.
+ */
+void IDE_write_burst(uint8_t reg, const uint16_t *src, int n) {
+    kernels->write_burst(reg, src, n);
+}
+
+
+void IDE_set_intrq_callback(IDE_Callback cb, void *ctx) {
+    HAL_NVIC_DisableIRQ(EXTI9_5_IRQn);
+    intrq_callback = cb;
+    intrq_ctx = ctx;
+    HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin) {
+    if (GPIO_Pin == (0x01 << IDE_INTRQ_PIN) && intrq_callback) {
+        intrq_callback(intrq_ctx);
+    }
+}
+
+
+/*
+ * Timer + DMA transfer engine
+ *
+ * TIM1 runs in one pulse mode with the repetition counter set to the word count,
+ * so it produces exactly one bus cycle per word and then stops by itself.
+ * Each cycle starts with the strobe high (recovery / address setup) and ends with it low.
+ *
+ * Reads:  the read strobe (PA11) is TIM1_CH4 in PWM mode 1, CC1 requests DMA1 ch2 to
+ *         copy GPIOB->IDR into the buffer once the data setup time has passed.
+ * Writes: the write strobe (PA12) is not a timer output, so it is driven by DMA writes
+ *         to GPIOA->BSRR. CC1 -> ch2 puts the word on GPIOB->ODR, CC2 -> ch3 pulls the
+ *         strobe low and CC3 -> ch6 releases it.
+ *
+ * DMA requests are serviced a variable number of cycles after the compare event, so every
+ * edge driven or sampled by DMA is given IDE_DMA_LATENCY_NS of margin on top of the PIO timing.
+ */
+
+#define IDE_DMA_LATENCY_NS 250
+#define IDE_DMA_MAX_WORDS 256 // limited by the 8 bit repetition counter
+
+// read strobe pin config in GPIOA->CRH
+#define IDE_READ_STROBE_CR_SHIFT ((IDE_READ_STROBE_PIN - 8) * 4)
+#define IDE_READ_STROBE_CR_GPIO 0x1  // output push pull, 10MHz
+#define IDE_READ_STROBE_CR_TIMER 0x9 // alternate function push pull, 10MHz
+
+TIM_HandleTypeDef htim_ide;
+DMA_HandleTypeDef hdma_ide_data;       // TIM1_CH1, data word to/from GPIOB
+DMA_HandleTypeDef hdma_ide_strobe_lo;  // TIM1_CH2, write strobe assert
+DMA_HandleTypeDef hdma_ide_strobe_hi;  // TIM1_CH3, write strobe release
+
+static const uint32_t strobe_lo = (0x01 << (IDE_WRITE_STROBE_PIN + 16));
+static const uint32_t strobe_hi = (0x01 << (IDE_WRITE_STROBE_PIN));
+
+static volatile bool dma_busy;
+static bool dma_writing;
+static IDE_Callback dma_callback;
+static void *dma_ctx;
+
+static void IDE_dma_complete(DMA_HandleTypeDef *hdma);
+
+// converts ns to TIM1 ticks, rounding up so the bus timing is never violated.
+static uint32_t IDE_tim_ticks(uint32_t ns) {
+    uint32_t mhz = HAL_RCC_GetPCLK2Freq() / 1000000;
+    return (ns * mhz + 999) / 1000;
+}
+
+static void IDE_dma_channel_init(DMA_HandleTypeDef *hdma, DMA_Channel_TypeDef *channel, uint32_t priority) {
+    hdma->Instance = channel;
+    hdma->Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma->Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma->Init.MemInc = DMA_MINC_DISABLE;
+    // GPIO registers can only be accessed as words
+    hdma->Init.PeriphDataAlignment = DMA_PDATAALIGN_WORD;
+    hdma->Init.MemDataAlignment = DMA_MDATAALIGN_WORD;
+    hdma->Init.Mode = DMA_NORMAL;
+    hdma->Init.Priority = priority;
+    HAL_DMA_Init(hdma);
+}
+
+static void IDE_dma_init() {
+    __HAL_RCC_TIM1_CLK_ENABLE();
+    __HAL_RCC_DMA1_CLK_ENABLE();
+
+    htim_ide.Instance = TIM1;
+    htim_ide.Init.Prescaler = 0;
+    htim_ide.Init.CounterMode = TIM_COUNTERMODE_UP;
+    htim_ide.Init.Period = 0xFFFF;
+    htim_ide.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+    htim_ide.Init.RepetitionCounter = 0;
+    htim_ide.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
+    HAL_TIM_PWM_Init(&htim_ide);
+
+    // read strobe, high until CCR4 then low until the end of the cycle.
+    // this leaves the pin high when the timer stops at 0.
+    TIM_OC_InitTypeDef oc = {0};
+    oc.OCMode = TIM_OCMODE_PWM1;
+    oc.OCPolarity = TIM_OCPOLARITY_HIGH;
+    oc.OCIdleState = TIM_OCIDLESTATE_SET;
+    oc.OCFastMode = TIM_OCFAST_DISABLE;
+    HAL_TIM_PWM_ConfigChannel(&htim_ide, &oc, TIM_CHANNEL_4);
+
+    // the other channels only time DMA requests.
+    oc.OCMode = TIM_OCMODE_TIMING;
+    HAL_TIM_OC_ConfigChannel(&htim_ide, &oc, TIM_CHANNEL_1);
+    HAL_TIM_OC_ConfigChannel(&htim_ide, &oc, TIM_CHANNEL_2);
+    HAL_TIM_OC_ConfigChannel(&htim_ide, &oc, TIM_CHANNEL_3);
+
+    htim_ide.Instance->CR1 |= TIM_CR1_OPM;
+    TIM_CCxChannelCmd(htim_ide.Instance, TIM_CHANNEL_4, TIM_CCx_ENABLE);
+    __HAL_TIM_MOE_ENABLE(&htim_ide);
+    __HAL_TIM_ENABLE_DMA(&htim_ide, TIM_DMA_CC1 | TIM_DMA_CC2 | TIM_DMA_CC3);
+
+    IDE_dma_channel_init(&hdma_ide_data, DMA1_Channel2, DMA_PRIORITY_VERY_HIGH);
+    IDE_dma_channel_init(&hdma_ide_strobe_lo, DMA1_Channel3, DMA_PRIORITY_HIGH);
+    IDE_dma_channel_init(&hdma_ide_strobe_hi, DMA1_Channel6, DMA_PRIORITY_HIGH);
+    hdma_ide_data.XferCpltCallback = IDE_dma_complete;
+    hdma_ide_strobe_hi.XferCpltCallback = IDE_dma_complete;
+
+    HAL_NVIC_SetPriority(DMA1_Channel2_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel2_IRQn);
+    HAL_NVIC_SetPriority(DMA1_Channel6_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel6_IRQn);
+}
+
+bool IDE_dma_busy() {
+    return dma_busy;
+}
+
+static void IDE_dma_start(uint32_t words) {
+    dma_busy = true;
+    htim_ide.Instance->CNT = 0;
+    htim_ide.Instance->RCR = words - 1;
+    // load the repetition counter without raising a DMA request or interrupt.
+    htim_ide.Instance->CR1 |= TIM_CR1_URS;
+    htim_ide.Instance->EGR = TIM_EGR_UG;
+    __HAL_TIM_CLEAR_FLAG(&htim_ide, TIM_FLAG_UPDATE | TIM_FLAG_CC1 | TIM_FLAG_CC2 | TIM_FLAG_CC3 | TIM_FLAG_CC4);
+    __HAL_TIM_ENABLE(&htim_ide);
+}
+
+/**
+ * Starts a DMA read of n words from a register, cb is called from interrupt context
+ * once the last word has landed in dst. The IDE bus must not be touched until then.
+ */
+bool IDE_dma_read(uint8_t reg, uint16_t *dst, int n, IDE_Callback cb, void *ctx) {
+    if (dma_busy || n < 1 || n > IDE_DMA_MAX_WORDS) {
+        return false;
+    }
+    const PioTiming *t = kernels->timing;
+    uint32_t recovery = IDE_tim_ticks(t->cycle - t->data_setup);
+    if (recovery < IDE_tim_ticks(t->addr_setup)) {
+        recovery = IDE_tim_ticks(t->addr_setup);
+    }
+    uint32_t setup = IDE_tim_ticks(t->data_setup);
+    uint32_t latency = IDE_tim_ticks(IDE_DMA_LATENCY_NS);
+
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_4, recovery);
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_1, recovery + setup);
+    __HAL_TIM_SET_AUTORELOAD(&htim_ide, recovery + setup + latency);
+
+    dma_writing = false;
+    dma_callback = cb;
+    dma_ctx = ctx;
+
     IDE_set_addr(reg);
-    //Address setup time;
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_DATA_SETUP));
-// strobe the write pin.
-    IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN + 16));
-    // write setup time
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_DATA_SETUP-NS_WRITE_SETUP));
-
-    // Push Value onto port
-    IDE_DATA_PORT->ODR = value;
-    // set port to write
-    IDE_DATA_PORT->CRL = IDE_PORT_WRITE;
-    IDE_DATA_PORT->CRH = IDE_PORT_WRITE;
-    
-    // write setup time
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_WRITE_SETUP));
-
-    //reset strobe
-    IDE_WRITE_STROBE_PORT->BSRR = (0x01 << (IDE_WRITE_STROBE_PIN));
-    // write hold time
-    STOPWATCH_DELAY(STOPWATCH_NS_TO_TICKS(NS_WRITE_HOLD));
-    //set port back to read
     IDE_DATA_PORT->ODR = IDE_ODR_READ;
     IDE_DATA_PORT->CRL = IDE_PORT_READ;
     IDE_DATA_PORT->CRH = IDE_PORT_READ;
+    // hand the read strobe over to the timer
+    GPIOA->CRH = (GPIOA->CRH & ~(0xF << IDE_READ_STROBE_CR_SHIFT)) | (IDE_READ_STROBE_CR_TIMER << IDE_READ_STROBE_CR_SHIFT);
+
+    hdma_ide_data.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_ide_data.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_ide_data.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    HAL_DMA_Init(&hdma_ide_data);
+    HAL_DMA_Start_IT(&hdma_ide_data, (uint32_t)&IDE_DATA_PORT->IDR, (uint32_t)dst, n);
+
+    IDE_dma_start(n);
+    return true;
+}
+
+/**
+ * Starts a DMA write of n words to a register, cb is called from interrupt context
+ * once the last strobe has been released. The IDE bus must not be touched until then.
+ */
+bool IDE_dma_write(uint8_t reg, const uint16_t *src, int n, IDE_Callback cb, void *ctx) {
+    if (dma_busy || n < 1 || n > IDE_DMA_MAX_WORDS) {
+        return false;
+    }
+    const PioTiming *t = kernels->timing;
+    uint32_t latency = IDE_tim_ticks(IDE_DMA_LATENCY_NS);
+    uint32_t data = IDE_tim_ticks(t->write_hold) + 1;
+    uint32_t strobe = data + latency;
+    if (strobe < IDE_tim_ticks(t->addr_setup)) {
+        strobe = IDE_tim_ticks(t->addr_setup);
+    }
+    // either strobe edge can be late by up to the latency, so pad the pulse by it.
+    uint32_t release = strobe + IDE_tim_ticks(t->data_setup) + latency;
+    uint32_t recovery = IDE_tim_ticks(t->cycle - t->data_setup);
+
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_1, data);
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_2, strobe);
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_3, release);
+    // keep CH4 from pulsing the read strobe, it stays on the GPIO anyway.
+    __HAL_TIM_SET_COMPARE(&htim_ide, TIM_CHANNEL_4, 0xFFFF);
+    __HAL_TIM_SET_AUTORELOAD(&htim_ide, release + latency + recovery);
+
+    dma_writing = true;
+    dma_callback = cb;
+    dma_ctx = ctx;
+
+    IDE_set_addr(reg);
+    IDE_DATA_PORT->ODR = src[0];
+    IDE_DATA_PORT->CRL = IDE_PORT_WRITE;
+    IDE_DATA_PORT->CRH = IDE_PORT_WRITE;
+
+    hdma_ide_data.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_ide_data.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_ide_data.Init.MemDataAlignment = DMA_MDATAALIGN_HALFWORD;
+    HAL_DMA_Init(&hdma_ide_data);
+    HAL_DMA_Start(&hdma_ide_data, (uint32_t)src, (uint32_t)&IDE_DATA_PORT->ODR, n);
+    HAL_DMA_Start(&hdma_ide_strobe_lo, (uint32_t)&strobe_lo, (uint32_t)&IDE_WRITE_STROBE_PORT->BSRR, n);
+    HAL_DMA_Start_IT(&hdma_ide_strobe_hi, (uint32_t)&strobe_hi, (uint32_t)&IDE_WRITE_STROBE_PORT->BSRR, n);
+
+    IDE_dma_start(n);
+    return true;
+}
+
+static void IDE_dma_complete(DMA_HandleTypeDef *hdma) {
+    // the timer stops itself at the end of the last cycle, which is at most a few ticks away.
+    while (htim_ide.Instance->CR1 & TIM_CR1_CEN);
+
+    if (dma_writing) {
+        HAL_DMA_Abort(&hdma_ide_data);
+        HAL_DMA_Abort(&hdma_ide_strobe_lo);
+        //set port back to read
+        IDE_DATA_PORT->ODR = IDE_ODR_READ;
+        IDE_DATA_PORT->CRL = IDE_PORT_READ;
+        IDE_DATA_PORT->CRH = IDE_PORT_READ;
+    } else {
+        // give the read strobe back to the GPIO, its output latch is still high.
+        GPIOA->CRH = (GPIOA->CRH & ~(0xF << IDE_READ_STROBE_CR_SHIFT)) | (IDE_READ_STROBE_CR_GPIO << IDE_READ_STROBE_CR_SHIFT);
+    }
+    dma_busy = false;
+    if (dma_callback) {
+        dma_callback(dma_ctx);
+    }
 }
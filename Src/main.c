@@ -26,6 +26,13 @@
 #include "ide_controller.h"
 #include "print.h"
 #include "ata_driver.h"
+#include "block_cache.h"
+#include "overdub.h"
+#include "playback.h"
+#include "record.h"
+#include "scrub.h"
+#include "timeline.h"
+#include "virtual_tape_driver.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -46,6 +53,8 @@
 //UART_HandleTypeDef huart3;
 
 /* USER CODE BEGIN PV */
+// section bounds from the linker script
+extern uint8_t _sramfunc, _eramfunc, _ebss;
 
 /* USER CODE END PV */
 
@@ -58,6 +67,8 @@ static void MX_GPIO_Init(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+// SystemClock_Config uses one flash wait state, which is only good up to 48MHz.
+_Static_assert(SYSCLK_HZ <= 48000000, "SYSCLK_HZ needs more flash latency");
 
 /* USER CODE END 0 */
 
@@ -94,23 +105,37 @@ int main(void)
   MX_GPIO_Init();
   /* USER CODE BEGIN 2 */
   IDE_init();
+  timeline_mark("ide");
   /* USER CODE END 2 */
 
   /* Infinite loop */
   /* USER CODE BEGIN WHILE */
   print_uart_init();
   print("Hello!\n\r");
+  print("RAM: %u bytes of code, %u bytes static of %u\r\n",
+    (unsigned int)(&_eramfunc - &_sramfunc), (unsigned int)(&_ebss - &_sramfunc), 20 * 1024);
   
-  ata_init();
+  timeline_mark("uart");
 
-  IDE_write(3, 0xFFFF);
-  HAL_Delay(10);
-  print("BIT TEST: 0x%04x \r\n", IDE_read(3));
+  ata_set_hotplug_callbacks(onDriveAttach, onDriveDetach, NULL);
+  ata_init();
+  timeline_mark("ready");
 
-  ata_read_disk(0, NULL, 1);
+  // the diagnostics can wait until we are ready to record
+  ata_print_identity();
+  timeline_print();
 
   while (1)
   {
+    // disk requests move along in between the rest of the main loop's work
+    ata_service();
+    ata_hotplug_service();
+    block_cache_service();
+    overdub_service();
+    record_service();
+    playback_service();
+    scrub_service();
+
     //set drive and wait for cable to respond.
     //IDE_write(6, 0x00A0);
     // HAL_Delay(1000);
@@ -148,7 +173,7 @@ void SystemClock_Config(void)
   RCC_OscInitStruct.HSIState = RCC_HSI_ON;
   RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
   RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_HSE;
-  RCC_OscInitStruct.PLL.PLLMUL = RCC_PLL_MUL6;
+  RCC_OscInitStruct.PLL.PLLMUL = SYSCLK_PLL_MUL;
   if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
   {
     Error_Handler();
@@ -0,0 +1,140 @@
+#include "overdub.h"
+
+#include "ata_driver.h"
+#include "playback.h"
+#include "print.h"
+#include "record.h"
+
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+/**
+ * What both rings together may take of the 20 KB. The rest goes to the block cache, the sector
+ * buffers and tables (512 B each), the RAM resident bus kernels, 1.5 KB of heap and stack, and the
+ * other statics. The linker's heap and stack check still has the final say.
+ */
+#define RING_RAM_BUDGET (6 * 1024)
+_Static_assert((RECORD_RING_SECTORS + PLAYBACK_RING_SECTORS) * 512 <= RING_RAM_BUDGET, "record and playback rings are over their RAM budget");
+
+static bool active = false;
+static uint32_t rate_tick = 0;
+static OverdubStats stats;
+
+// The card's write rate measured on the take, until there's enough of it the bus estimate stands in.
+static void overdub_update_rate() {
+    if (stats.card_kbps && HAL_GetTick() - rate_tick < OVERDUB_RATE_UPDATE_MS) {
+        return;
+    }
+    rate_tick = HAL_GetTick();
+    uint32_t measured = record_stats()->card_kbps;
+    stats.card_kbps = measured ? measured : ata_estimate_kbps();
+}
+
+/**
+ * Longest transfer, up to max sectors, that leaves the other ring above its low water mark
+ * for as long as it holds the bus. A ring already below it gets the bus back after a single sector.
+ */
+static uint32_t overdub_size(uint32_t other_margin_ms, uint32_t other_low_ms, uint32_t max) {
+    if (other_margin_ms <= other_low_ms) {
+        return 1;
+    }
+    uint32_t budget_us = (other_margin_ms - other_low_ms) * 1000;
+    if (budget_us <= OVERDUB_COMMAND_US) {
+        return 1;
+    }
+    // KB/s is bytes per ms
+    uint32_t sectors = (uint64_t)(budget_us - OVERDUB_COMMAND_US) * stats.card_kbps / 512000;
+    if (sectors < 1) {
+        return 1;
+    }
+    return sectors < max ? sectors : max;
+}
+
+static void overdub_track(uint32_t margin, uint32_t low, uint32_t *last, uint32_t *min, uint32_t *events) {
+    if (margin < low && *last >= low) {
+        (*events)++;
+    }
+    if (margin < *min) {
+        *min = margin;
+    }
+    *last = margin;
+}
+
+uint16_t overdub_start(int play_channel, uint32_t play_sample, int record_channel, uint32_t record_lba) {
+    if (active) {
+        return ATA_ERR_BUSY;
+    }
+    // playback first, its pre-roll would otherwise eat into the record ring.
+    uint16_t err = playback_locate(play_channel, play_sample);
+    if (err) {
+        return err;
+    }
+    err = record_start(record_channel, record_lba);
+    if (err) {
+        playback_stop();
+        return err;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.record_low_water_ms = record_ring_ms() * OVERDUB_LOW_WATER_PCT / 100;
+    stats.playback_low_water_ms = playback_ring_ms() * OVERDUB_LOW_WATER_PCT / 100;
+    stats.record_margin_ms = record_margin_ms();
+    stats.playback_margin_ms = playback_margin_ms();
+    stats.record_min_margin_ms = stats.record_margin_ms;
+    stats.playback_min_margin_ms = stats.playback_margin_ms;
+    active = true;
+    overdub_service();
+    return 0;
+}
+
+void overdub_stop() {
+    if (!active) {
+        return;
+    }
+    active = false;
+    record_stop();
+    playback_stop();
+    // on their own each engine has the bus to itself again.
+    record_set_run_sectors(RECORD_RUN_SECTORS);
+    playback_set_run_sectors(PLAYBACK_RUN_SECTORS);
+}
+
+bool overdub_active() {
+    return active;
+}
+
+void overdub_service() {
+    if (!active) {
+        return;
+    }
+    // either side stopping, at the end of the tape or on an error, ends the overdub.
+    if (!record_active() || !playback_active()) {
+        print("Overdub: %s stopped\r\n", record_active() ? "playback" : "record");
+        overdub_stop();
+        return;
+    }
+    overdub_update_rate();
+    uint32_t rec = record_margin_ms();
+    uint32_t play = playback_margin_ms();
+    overdub_track(rec, stats.record_low_water_ms, &stats.record_margin_ms,
+        &stats.record_min_margin_ms, &stats.record_low_events);
+    overdub_track(play, stats.playback_low_water_ms, &stats.playback_margin_ms,
+        &stats.playback_min_margin_ms, &stats.playback_low_events);
+    stats.record_run = overdub_size(play, stats.playback_low_water_ms, RECORD_RUN_SECTORS);
+    stats.playback_run = overdub_size(rec, stats.record_low_water_ms, PLAYBACK_RUN_SECTORS);
+    record_set_run_sectors(stats.record_run);
+    playback_set_run_sectors(stats.playback_run);
+}
+
+const OverdubStats *overdub_stats() {
+    return &stats;
+}
+
+void overdub_print_stats() {
+    print("Overdub: record margin %u ms (min %u, low %u, %u dips), %u sector writes\r\n",
+        stats.record_margin_ms, stats.record_min_margin_ms, stats.record_low_water_ms,
+        stats.record_low_events, stats.record_run);
+    print("Overdub: playback margin %u ms (min %u, low %u, %u dips), %u sector reads, %u KB/s\r\n",
+        stats.playback_margin_ms, stats.playback_min_margin_ms, stats.playback_low_water_ms,
+        stats.playback_low_events, stats.playback_run, stats.card_kbps);
+}
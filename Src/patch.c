@@ -0,0 +1,195 @@
+#include "patch.h"
+
+#include "block_cache.h"
+#include "print.h"
+#include "scrub.h"
+
+#include <string.h>
+
+#define PATCH_MAGIC 0x48435450 // "PTCH" in ascii
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t lba;       // first tape sector it covers, tape relative
+    uint32_t count;
+    uint32_t patch_lba; // card LBA of the new audio for the first sector
+} PatchEntry;
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic_number;
+    uint16_t count;       // entries in use
+    uint16_t reserved;
+    uint32_t pool_lba;
+    uint32_t pool_len;
+    uint32_t pool_used;   // patch sectors handed out so far
+    PatchEntry entry[PATCH_MAX_ENTRIES]; // sorted by lba, never overlapping
+} PatchTable;
+
+_Static_assert(sizeof(PatchTable) == 512, "the patch table is one sector");
+
+static PatchTable table;
+static uint32_t table_lba = 0;
+static bool loaded = false;
+
+// Patch sectors handed out hold audio just like the tape, the scrubber goes over them too.
+static void patch_scrub() {
+    scrub_region(SCRUB_REGION_PATCHES, table.pool_lba, table.pool_used);
+}
+
+static void patch_reset(uint32_t lba, uint32_t pool_lba, uint32_t pool_len) {
+    memset(&table, 0, sizeof(table));
+    table.magic_number = PATCH_MAGIC;
+    table.pool_lba = pool_lba;
+    table.pool_len = pool_len;
+    table_lba = lba;
+}
+
+void patch_load(uint32_t lba, uint32_t pool_lba, uint32_t pool_len) {
+    patch_reset(lba, pool_lba, pool_len);
+    const PatchTable *stored = (const PatchTable *)block_cache_get(lba);
+    // a tape formatted before the table existed starts out without patches, and so does one whose
+    // patches sit somewhere the reserved area no longer keeps them.
+    if (stored && stored->magic_number == PATCH_MAGIC && stored->count <= PATCH_MAX_ENTRIES &&
+        stored->pool_lba == pool_lba && stored->pool_len == pool_len) {
+        memcpy(&table, stored, sizeof(table));
+    }
+    loaded = true;
+    patch_scrub();
+}
+
+uint16_t patch_format(uint32_t lba, uint32_t pool_lba, uint32_t pool_len) {
+    patch_reset(lba, pool_lba, pool_len);
+    loaded = true;
+    patch_scrub();
+    return patch_save();
+}
+
+void patch_unload() {
+    patch_reset(0, 0, 0);
+    loaded = false;
+    patch_scrub();
+}
+
+uint16_t patch_save() {
+    uint8_t *sector = block_cache_get_blank(table_lba);
+    if (!sector) {
+        // unknown error;
+        return 0xFFFF;
+    }
+    memcpy(sector, &table, sizeof(table));
+    block_cache_dirty(table_lba);
+    patch_scrub();
+    return 0;
+}
+
+void patch_discard() {
+    if (loaded) {
+        patch_load(table_lba, table.pool_lba, table.pool_len);
+    }
+}
+
+// First entry that ends past lba, ends are sorted just like starts.
+static int patch_search(uint32_t lba) {
+    int lo = 0;
+    int hi = table.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (table.entry[mid].lba + table.entry[mid].count <= lba) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+bool patch_lookup(uint32_t lba, uint32_t *run, uint32_t *patch_lba) {
+    // most tapes are never punched into, don't make them pay for the search.
+    if (!table.count) {
+        *run = UINT32_MAX;
+        return false;
+    }
+    int i = patch_search(lba);
+    if (i == table.count) {
+        *run = UINT32_MAX;
+        return false;
+    }
+    const PatchEntry *e = &table.entry[i];
+    if (lba < e->lba) {
+        *run = e->lba - lba;
+        return false;
+    }
+    *run = e->lba + e->count - lba;
+    *patch_lba = e->patch_lba + (lba - e->lba);
+    return true;
+}
+
+/**
+ * Takes a range out of the table, trimming or splitting the entries it overlaps, then puts
+ * insert in its place if there is one. Returns false, changing nothing, if it won't fit.
+ */
+static bool patch_cut(uint32_t lba, uint32_t count, const PatchEntry *insert) {
+    uint32_t end = lba + count;
+    int i = patch_search(lba);
+    int j = i;
+    while (j < table.count && table.entry[j].lba < end) {
+        j++;
+    }
+    PatchEntry left;
+    PatchEntry right;
+    bool has_left = false;
+    bool has_right = false;
+    if (i < j && table.entry[i].lba < lba) {
+        left = table.entry[i];
+        left.count = lba - left.lba;
+        has_left = true;
+    }
+    if (i < j) {
+        const PatchEntry *last = &table.entry[j - 1];
+        uint32_t last_end = last->lba + last->count;
+        if (last_end > end) {
+            right.lba = end;
+            right.count = last_end - end;
+            right.patch_lba = last->patch_lba + (end - last->lba);
+            has_right = true;
+        }
+    }
+    int added = has_left + (insert != NULL) + has_right;
+    if (table.count - (j - i) + added > PATCH_MAX_ENTRIES) {
+        return false;
+    }
+    memmove(&table.entry[i + added], &table.entry[j], (table.count - j) * sizeof(PatchEntry));
+    table.count += added - (j - i);
+    if (has_left) {
+        table.entry[i++] = left;
+    }
+    if (insert) {
+        table.entry[i++] = *insert;
+    }
+    if (has_right) {
+        table.entry[i++] = right;
+    }
+    return true;
+}
+
+uint16_t patch_add(uint32_t lba, uint32_t count) {
+    if (!loaded || !count || count > table.pool_len - table.pool_used) {
+        return PATCH_ERR_FULL;
+    }
+    PatchEntry e = { lba, count, table.pool_lba + table.pool_used };
+    if (!patch_cut(lba, count, &e)) {
+        return PATCH_ERR_FULL;
+    }
+    table.pool_used += count;
+    return 0;
+}
+
+uint16_t patch_remove(uint32_t lba, uint32_t count) {
+    if (!loaded || !count) {
+        return 0;
+    }
+    return patch_cut(lba, count, NULL) ? 0 : PATCH_ERR_FULL;
+}
+
+void patch_print_stats() {
+    print("Patch: %u patches, %u of %u patch sectors used\r\n", table.count, table.pool_used, table.pool_len);
+}
@@ -0,0 +1,349 @@
+#include "playback.h"
+
+#include "ata_driver.h"
+#include "print.h"
+#include "remap.h"
+#include "stopwatch.h"
+#include "virtual_tape_driver.h"
+
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#define PLAYBACK_RING_BYTES (PLAYBACK_RING_SECTORS * 512)
+
+_Static_assert(PLAYBACK_RING_SECTORS % PLAYBACK_RUN_SECTORS == 0, "runs have to tile the ring");
+_Static_assert(PLAYBACK_PREROLL_SECTORS <= PLAYBACK_RUN_SECTORS, "pre-roll has to fit the shortest read ahead");
+
+typedef struct {
+    AtaRequest req;
+    uint32_t lba;        // tape relative, req.lba is where it really comes from and can be a spare
+    volatile bool done;
+    volatile bool owned; // the driver still has it
+} PlaybackRun;
+
+// aligned for the DMA engine, runs land straight in the ring.
+static uint8_t ring[PLAYBACK_RING_BYTES] __attribute__((aligned(4)));
+// byte counts since the locate, ring byte 0 is the start of the located sector.
+static volatile uint32_t head = 0;  // landed in the ring
+static uint32_t issued = 0;         // asked of the drive
+static volatile uint32_t tail = 0;  // handed to the output side
+
+static PlaybackRun runs[PLAYBACK_RUNS];
+static int run_first = 0; // oldest run in flight
+static int run_count = 0;
+
+static volatile bool playing = false;
+static bool active = false;
+static uint32_t readahead = PLAYBACK_RING_SECTORS;
+static uint32_t run_sectors = PLAYBACK_RUN_SECTORS;
+static int channel = TAPE_ALL_CHANNELS;
+static uint32_t issue_lba = 0;    // sector of the stream at issued
+static uint32_t stream_len = 0;
+static uint32_t frame_len = 0;
+static uint32_t bytes_per_ms = 0;
+static uint32_t located_sample = 0;
+static uint32_t located_offset = 0; // where the located sample starts in its sector
+static PlaybackStats stats;
+
+void playback_set_readahead(uint32_t sectors) {
+    if (sectors < PLAYBACK_RUN_SECTORS) {
+        sectors = PLAYBACK_RUN_SECTORS;
+    }
+    readahead = sectors < PLAYBACK_RING_SECTORS ? sectors : PLAYBACK_RING_SECTORS;
+}
+
+static void playback_done(AtaRequest *req) {
+    PlaybackRun *run = (PlaybackRun *)req->ctx;
+    run->owned = false;
+    run->done = true;
+}
+
+static void playback_fail(uint16_t err) {
+    stats.error = err;
+    playing = false;
+    active = false;
+    print("Playback: stopped at LBA %u, error 0x%04x\r\n", issue_lba, err);
+}
+
+/**
+ * Services the drive until flag reads want, for up to PLAYBACK_WAIT_MS. Hot-plug gets serviced as
+ * well, so a card pulled meanwhile fails what is queued rather than holding up the whole firmware.
+ */
+static uint16_t playback_wait(volatile bool *flag, bool want) {
+    uint32_t start = HAL_GetTick();
+    while (*flag != want) {
+        if (HAL_GetTick() - start > PLAYBACK_WAIT_MS) {
+            return ATA_ERR_TIMEOUT;
+        }
+        ata_service();
+        ata_hotplug_service();
+    }
+    return 0;
+}
+
+// Reads aimed at the old position are dropped, ones already on the bus have to land first.
+// One that doesn't land in time keeps its run, the next locate tries again.
+static uint16_t playback_drop_runs() {
+    for (int i = 0; i < PLAYBACK_RUNS; i++) {
+        if (runs[i].owned && ata_cancel(&runs[i].req) == 0) {
+            runs[i].owned = false;
+        }
+        uint16_t err = playback_wait(&runs[i].owned, false);
+        if (err) {
+            return err;
+        }
+    }
+    run_first = 0;
+    run_count = 0;
+    return 0;
+}
+
+/**
+ * Queues a read of up to max sectors into the free part of the ring.
+ * Returns false when there isn't room for it yet, or the tape has run out.
+ */
+static bool playback_issue(uint32_t max, uint32_t deadline) {
+    uint32_t used = issued / 512 - tail / 512;
+    uint32_t room = readahead > used ? readahead - used : 0;
+    uint32_t left = stream_len - issue_lba;
+    uint32_t want = max < left ? max : left;
+    if (want == 0 || room < want) {
+        return false;
+    }
+    const VirtualTape *tape = getTape();
+    if (!tape) {
+        playback_fail(ATA_ERR_NO_MEDIA);
+        return false;
+    }
+    uint32_t pos = issued % PLAYBACK_RING_BYTES;
+    uint32_t n = want;
+    if (n > (PLAYBACK_RING_BYTES - pos) / 512) {
+        n = (PLAYBACK_RING_BYTES - pos) / 512;
+    }
+    // a planar track only runs on to the end of its chunk.
+    uint32_t contiguous;
+    uint32_t tape_lba = tapeStreamLba(channel, issue_lba, &contiguous);
+    if (n > contiguous) {
+        n = contiguous;
+    }
+    // a punched-in range comes from its patch, one lookup for the whole run.
+    uint32_t resolved;
+    bool patched;
+    uint32_t lba = tapeResolve(tape_lba, &resolved, &patched);
+    if (n > resolved) {
+        n = resolved;
+    }
+    n = remap_run(lba, n);
+
+    PlaybackRun *run = &runs[(run_first + run_count) % PLAYBACK_RUNS];
+    run->req.op = ATA_OP_READ;
+    run->req.lba = remap_lookup(lba);
+    run->req.data = &ring[pos];
+    run->req.count = n;
+    run->req.done = playback_done;
+    run->req.ctx = run;
+    run->req.deadline = deadline;
+    run->lba = tape_lba;
+    run->done = false;
+    run->owned = true;
+    uint16_t err = ata_queue(&run->req);
+    if (err) {
+        run->owned = false;
+        if (err != ATA_ERR_BUSY) {
+            playback_fail(err);
+        }
+        return false;
+    }
+    issued += n * 512;
+    issue_lba += n;
+    run_count++;
+    return true;
+}
+
+static void playback_retire(PlaybackRun *run) {
+    uint16_t err = run->req.result;
+    if (ATA_ERR_FROM_DRIVE(err)) {
+        // the driver already gave up on it, try once more a run at a time through the remap table.
+        while (ata_busy()) {
+            ata_service();
+        }
+        err = readTape(run->lba, run->req.data, run->req.count);
+        if (ATA_ERR_FROM_DRIVE(err)) {
+            // a click beats stopping the transport.
+            memset(run->req.data, 0, run->req.count * 512);
+            stats.read_errors++;
+            print("Playback: unreadable sectors at LBA %u, played as silence\r\n", run->lba);
+            err = 0;
+        }
+    }
+    if (err) {
+        playback_fail(err);
+        return;
+    }
+    // the sectors have to be in the ring before the output side can see them.
+    __DMB();
+    head += run->req.count * 512;
+}
+
+static void playback_retire_done() {
+    // retire in order, the ring only fills up from the head.
+    while (active && run_count && runs[run_first].done) {
+        PlaybackRun *run = &runs[run_first];
+        run_first = (run_first + 1) % PLAYBACK_RUNS;
+        run_count--;
+        playback_retire(run);
+    }
+}
+
+uint16_t playback_locate(int ch, uint32_t sample) {
+    uint32_t start = STOPWATCH_GET_TICKS();
+    playing = false;
+    active = false;
+    // the ring can't be reused while a read could still land in it.
+    uint16_t err = playback_drop_runs();
+    if (err) {
+        return err;
+    }
+    const VirtualTape *tape = getTape();
+    if (!tape) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    uint32_t frame = tapeFrameBytes(ch);
+    if (!frame) {
+        return ATA_ERR_UNSUPPORTED;
+    }
+    uint64_t byte = (uint64_t)sample * frame;
+    if (byte + frame > (uint64_t)tapeStreamSectors(ch) * 512) {
+        return ATA_ERR_RANGE;
+    }
+    // the locate times are kept across locates, the rest is per locate.
+    uint32_t worst_locate_us = stats.worst_locate_us;
+    uint32_t locates = stats.locates;
+    memset(&stats, 0, sizeof(stats));
+    channel = ch;
+    frame_len = frame;
+    bytes_per_ms = tape->sample_rate * frame_len / 1000;
+    stream_len = tapeStreamSectors(ch);
+    issue_lba = byte / 512;
+    located_sample = sample;
+    located_offset = byte % 512;
+    head = 0;
+    issued = 0;
+    tail = located_offset;
+    stats.low_water = PLAYBACK_RING_BYTES;
+    active = true;
+
+    // pre-roll, the first sample only waits for a short read of its own. Nothing else is queued
+    // until it has landed, so the queue can't merge a longer read into it. A frame that straddles
+    // two sectors needs one more.
+    uint32_t wait_start = HAL_GetTick();
+    while (active && (int32_t)(head - tail) < (int32_t)frame_len) {
+        uint32_t sectors = issued ? 1 : PLAYBACK_PREROLL_SECTORS;
+        if (!run_count && !playback_issue(sectors, HAL_GetTick())) {
+            // the queue is full, it drains as the drive works through it.
+            if (HAL_GetTick() - wait_start > PLAYBACK_WAIT_MS) {
+                playback_fail(ATA_ERR_TIMEOUT);
+                break;
+            }
+            ata_service();
+            ata_hotplug_service();
+            continue;
+        }
+        err = playback_wait(&runs[run_first].done, true);
+        if (err) {
+            playback_fail(err);
+            break;
+        }
+        playback_retire_done();
+    }
+    if (!active) {
+        return stats.error;
+    }
+    stats.locate_us = (STOPWATCH_GET_TICKS() - start) / (CLK_SPEED / 1000000);
+    stats.worst_locate_us = stats.locate_us > worst_locate_us ? stats.locate_us : worst_locate_us;
+    stats.locates = locates + 1;
+    playing = true;
+    return 0;
+}
+
+void playback_stop() {
+    playing = false;
+    active = false;
+    // reads still out are left to land, the next locate waits for them.
+}
+
+bool playback_active() {
+    return active;
+}
+
+uint32_t playback_read(uint8_t *frames, uint32_t n_frames) {
+    if (!playing) {
+        return 0;
+    }
+    uint32_t t = tail;
+    uint32_t avail = head - t;
+    if (avail < stats.low_water) {
+        stats.low_water = avail;
+    }
+    uint32_t given = n_frames;
+    if (given * frame_len > avail) {
+        given = avail / frame_len;
+        // past the last sector there is nothing left to wait for.
+        if (issue_lba >= stream_len && run_count == 0) {
+            stats.end_of_tape = true;
+        } else {
+            stats.underruns++;
+        }
+    }
+    uint32_t bytes = given * frame_len;
+    uint32_t pos = t % PLAYBACK_RING_BYTES;
+    uint32_t first = bytes < PLAYBACK_RING_BYTES - pos ? bytes : PLAYBACK_RING_BYTES - pos;
+    memcpy(frames, &ring[pos], first);
+    memcpy(frames + first, ring, bytes - first);
+    // done with the ring before its room is handed back to the reads.
+    __DMB();
+    tail = t + bytes;
+    return given;
+}
+
+void playback_service() {
+    if (!active) {
+        return;
+    }
+    playback_retire_done();
+    // due by the time the output side would run through what's buffered.
+    uint32_t deadline = HAL_GetTick() + (bytes_per_ms ? (head - tail) / bytes_per_ms : 0);
+    while (active && run_count < PLAYBACK_RUNS && playback_issue(run_sectors, deadline)) {
+    }
+}
+
+void playback_set_run_sectors(uint32_t sectors) {
+    if (sectors < 1) {
+        sectors = 1;
+    }
+    run_sectors = sectors < PLAYBACK_RUN_SECTORS ? sectors : PLAYBACK_RUN_SECTORS;
+}
+
+uint32_t playback_margin_ms() {
+    if (!playing || !bytes_per_ms) {
+        return 0;
+    }
+    return (head - tail) / bytes_per_ms;
+}
+
+uint32_t playback_ring_ms() {
+    return bytes_per_ms ? (readahead * 512) / bytes_per_ms : 0;
+}
+
+const PlaybackStats *playback_stats() {
+    stats.sample = frame_len ? located_sample + (tail - located_offset) / frame_len : 0;
+    return &stats;
+}
+
+void playback_print_stats() {
+    const PlaybackStats *s = playback_stats();
+    print("Playback: sample %u, locate %u us (worst %u), %u underruns, low water %u of %u bytes\r\n",
+        s->sample, s->locate_us, s->worst_locate_us, s->underruns, s->low_water, PLAYBACK_RING_BYTES);
+    print("Playback: %u unreadable runs%s\r\n", s->read_errors, s->end_of_tape ? ", end of tape" : "");
+}
@@ -0,0 +1,406 @@
+#include "record.h"
+
+#include "ata_driver.h"
+#include "patch.h"
+#include "print.h"
+#include "remap.h"
+#include "stopwatch.h"
+#include "virtual_tape_driver.h"
+
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+#define RECORD_RING_BYTES (RECORD_RING_SECTORS * 512)
+
+_Static_assert(RECORD_RING_SECTORS % RECORD_RUN_SECTORS == 0, "runs have to tile the ring");
+
+typedef struct {
+    AtaRequest req;
+    uint32_t lba;           // tape relative, req.lba is where it really goes and can be a spare
+    uint32_t sector;        // of the stream
+    uint32_t queued_ticks;  // stopwatch, when it went into the ATA queue
+    volatile bool done;
+    bool owned;             // the driver still has it
+} RecordRun;
+
+// aligned for the DMA engine, runs are handed to it straight out of the ring.
+static uint8_t ring[RECORD_RING_BYTES] __attribute__((aligned(4)));
+// byte counts since record_start, free running, only their differences matter.
+static volatile uint32_t head = 0;  // appended by the capture side
+static uint32_t issued = 0;         // handed to the drive
+static volatile uint32_t tail = 0;  // on the card, their room in the ring is free again
+static uint64_t tape_bytes_left = 0; // from head to the end of the tape, or of the punch-in
+
+static RecordRun runs[RECORD_RUNS];
+static int run_first = 0; // oldest run in flight
+static int run_count = 0;
+
+static volatile bool capturing = false;
+static bool active = false;
+static bool punching = false;     // the take goes into patches, they stick once it's done
+static int channel = TAPE_ALL_CHANNELS;
+static uint32_t end_lba = 0;      // sector of the stream the take has to stop at
+static uint32_t issue_lba = 0;    // sector of the stream at issued
+static uint32_t run_sectors = RECORD_RUN_SECTORS;
+static uint32_t frame_len = 0;
+static uint32_t bytes_per_ms = 0;
+
+static uint32_t start_tick = 0;
+static uint32_t stop_tick = 0;
+static uint32_t last_done_ticks = 0;
+static uint64_t busy_us = 0;
+static RecordStats stats;
+
+// Whether a take over count sectors from lba can start.
+static uint16_t record_check(int ch, uint32_t lba, uint32_t count) {
+    if (!getTape()) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    if (active) {
+        return ATA_ERR_BUSY;
+    }
+    // a take that failed can still have writes out, they point into the ring.
+    for (int i = 0; i < RECORD_RUNS; i++) {
+        if (runs[i].owned) {
+            return ATA_ERR_BUSY;
+        }
+    }
+    if (!tapeFrameBytes(ch)) {
+        return ATA_ERR_UNSUPPORTED;
+    }
+    uint32_t stream_len = tapeStreamSectors(ch);
+    if (lba >= stream_len || count > stream_len - lba) {
+        return ATA_ERR_RANGE;
+    }
+    return 0;
+}
+
+static void record_begin(int ch, uint32_t lba, uint32_t count, bool punch) {
+    const VirtualTape *tape = getTape();
+    memset(&stats, 0, sizeof(stats));
+    head = 0;
+    issued = 0;
+    tail = 0;
+    tape_bytes_left = (uint64_t)count * 512;
+    run_first = 0;
+    run_count = 0;
+    channel = ch;
+    end_lba = lba + count;
+    issue_lba = lba;
+    punching = punch;
+    frame_len = tapeFrameBytes(ch);
+    bytes_per_ms = tape->sample_rate * frame_len / 1000;
+    start_tick = HAL_GetTick();
+    last_done_ticks = STOPWATCH_GET_TICKS();
+    busy_us = 0;
+    active = true;
+    // last, the capture side can start as soon as it's set.
+    capturing = true;
+}
+
+uint16_t record_start(int ch, uint32_t lba) {
+    uint16_t err = record_check(ch, lba, 0);
+    if (!err) {
+        // from here on the header can't claim any of the stream is erased, until the take is closed.
+        err = tapeOpenTake(ch);
+    }
+    if (err) {
+        return err;
+    }
+    record_begin(ch, lba, tapeStreamSectors(ch) - lba, false);
+    return 0;
+}
+
+// Calls fn on each stretch of the tape a range of the stream covers, a planar track is one per chunk.
+static uint16_t record_each_run(uint32_t lba, uint32_t count, uint16_t (*fn)(uint32_t, uint32_t)) {
+    while (count) {
+        uint32_t contiguous;
+        uint32_t tape_lba = tapeStreamLba(channel, lba, &contiguous);
+        uint32_t n = count < contiguous ? count : contiguous;
+        uint16_t err = fn(tape_lba, n);
+        if (err) {
+            return err;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+uint16_t record_punch(int ch, uint32_t lba, uint32_t count) {
+    uint16_t err = record_check(ch, lba, count);
+    if (err) {
+        return err;
+    }
+    if (!count) {
+        return ATA_ERR_RANGE;
+    }
+    channel = ch;
+    // the patches go in up front, so the take's writes resolve to them like playback's reads will.
+    err = record_each_run(lba, count, patch_add);
+    if (err) {
+        patch_discard();
+        return err;
+    }
+    record_begin(ch, lba, count, true);
+    return 0;
+}
+
+// Makes the patches of a finished punch-in stick, the part of the range it never got to stays as it was.
+// Only call it once the take is checkpointed, the audio has to be on the media before the table pointing at it.
+static uint16_t record_keep_punch() {
+    uint16_t err = record_each_run(issue_lba, end_lba - issue_lba, patch_remove);
+    if (!err) {
+        err = patch_save();
+    }
+    if (!err) {
+        err = checkpointDisk();
+    }
+    return err;
+}
+
+void record_stop() {
+    if (!capturing) {
+        return;
+    }
+    // the capture interrupt runs to completion, once this is clear it won't touch the ring again.
+    capturing = false;
+    // pad the last sector out with silence, the take starts on a sector so head tells how much is missing.
+    uint32_t partial = head % 512;
+    if (partial) {
+        memset(&ring[head % RECORD_RING_BYTES], 0, 512 - partial);
+        head += 512 - partial;
+    }
+}
+
+bool record_active() {
+    return active;
+}
+
+uint8_t *record_borrow_ring() {
+    return active ? NULL : ring;
+}
+
+uint32_t record_write(const uint8_t *frames, uint32_t n_frames) {
+    if (!capturing) {
+        return 0;
+    }
+    uint32_t h = head;
+    uint32_t room = RECORD_RING_BYTES - (h - tail);
+    bool at_end = tape_bytes_left < room;
+    if (at_end) {
+        room = tape_bytes_left;
+    }
+    uint32_t taken = n_frames;
+    if (taken * frame_len > room) {
+        taken = room / frame_len;
+        if (at_end) {
+            stats.end_of_tape = true;
+        } else {
+            stats.overruns++;
+            stats.dropped_frames += n_frames - taken;
+        }
+    }
+    uint32_t bytes = taken * frame_len;
+    uint32_t pos = h % RECORD_RING_BYTES;
+    uint32_t first = bytes < RECORD_RING_BYTES - pos ? bytes : RECORD_RING_BYTES - pos;
+    memcpy(&ring[pos], frames, first);
+    memcpy(ring, frames + first, bytes - first);
+    // the frames have to be in the ring before record_service can see them.
+    __DMB();
+    head = h + bytes;
+    tape_bytes_left -= bytes;
+    if (head - tail > stats.high_water) {
+        stats.high_water = head - tail;
+    }
+    return taken;
+}
+
+static void record_done(AtaRequest *req) {
+    RecordRun *run = (RecordRun *)req->ctx;
+    uint32_t now = STOPWATCH_GET_TICKS();
+    // only count the time the card spent on the take, a run starts once the one before it is done.
+    uint32_t from = (int32_t)(last_done_ticks - run->queued_ticks) > 0 ? last_done_ticks : run->queued_ticks;
+    busy_us += (now - from) / (CLK_SPEED / 1000000);
+    last_done_ticks = now;
+    run->owned = false;
+    run->done = true;
+}
+
+static void record_fail(uint16_t err) {
+    stats.error = err;
+    capturing = false;
+    active = false;
+    stop_tick = HAL_GetTick();
+    if (punching) {
+        // a failed punch-in leaves the tape sounding like it did before.
+        patch_discard();
+    } else {
+        // every run issued so far is already past the mark, whether it made it or not.
+        tapeCloseTake(channel);
+    }
+    print("Record: stopped at LBA %u, error 0x%04x\r\n", issue_lba, err);
+}
+
+static void record_retire(RecordRun *run) {
+    uint16_t err = run->req.result;
+    if (ATA_ERR_FROM_DRIVE(err)) {
+        // the driver already gave up on it, go over it a sector at a time and move the bad ones to spares.
+        while (ata_busy()) {
+            ata_service();
+        }
+        err = writeTape(run->lba, run->req.data, run->req.count);
+    }
+    if (err) {
+        record_fail(err);
+        return;
+    }
+    tail += run->req.count * 512;
+    stats.sectors += run->req.count;
+}
+
+// Queues the next run, once a full one is waiting, or whatever is left when the take is over.
+static bool record_issue(bool final) {
+    uint32_t pending = (head - issued) / 512;
+    if (pending == 0 || (pending < run_sectors && !final)) {
+        return false;
+    }
+    const VirtualTape *tape = getTape();
+    if (!tape) {
+        record_fail(ATA_ERR_NO_MEDIA);
+        return false;
+    }
+    uint32_t pos = issued % RECORD_RING_BYTES;
+    uint32_t n = pending < run_sectors ? pending : run_sectors;
+    if (n > (RECORD_RING_BYTES - pos) / 512) {
+        n = (RECORD_RING_BYTES - pos) / 512;
+    }
+    // a planar track only runs on to the end of its chunk.
+    uint32_t contiguous;
+    uint32_t tape_lba = tapeStreamLba(channel, issue_lba, &contiguous);
+    if (n > contiguous) {
+        n = contiguous;
+    }
+    // a punch-in writes into its patches, one lookup for the whole run.
+    uint32_t resolved;
+    bool patched;
+    uint32_t lba = tapeResolve(tape_lba, &resolved, &patched);
+    if (n > resolved) {
+        n = resolved;
+    }
+    n = remap_run(lba, n);
+    uint32_t actual = remap_lookup(lba);
+
+    RecordRun *run = &runs[(run_first + run_count) % RECORD_RUNS];
+    // only sectors still erased since the format skip the erase, spares and patches never are.
+    bool erased = !patched && actual == lba && tapeErased(channel, issue_lba);
+    run->req.op = erased ? ATA_OP_WRITE_ERASED : ATA_OP_WRITE;
+    run->req.lba = actual;
+    run->req.data = &ring[pos];
+    run->req.count = n;
+    run->req.done = record_done;
+    run->req.ctx = run;
+    // due by the time the capture side would fill the ring up behind it.
+    uint32_t room = RECORD_RING_BYTES - (head - tail);
+    run->req.deadline = HAL_GetTick() + (bytes_per_ms ? room / bytes_per_ms : 0);
+    run->lba = tape_lba;
+    run->sector = issue_lba;
+    run->done = false;
+    run->owned = true;
+    run->queued_ticks = STOPWATCH_GET_TICKS();
+    uint16_t err = ata_queue(&run->req);
+    if (err) {
+        run->owned = false;
+        if (err != ATA_ERR_BUSY) {
+            record_fail(err);
+        }
+        return false;
+    }
+    issued += n * 512;
+    issue_lba += n;
+    run_count++;
+    if (!patched) {
+        // the mark moves on as runs go out, a take that fails still has them covered. The take is open,
+        // so this doesn't touch the card.
+        tapeWritten(channel, run->sector, n);
+    }
+    return true;
+}
+
+void record_service() {
+    if (!active) {
+        return;
+    }
+    // retire in order, the ring only frees up from the tail.
+    while (run_count && runs[run_first].done) {
+        RecordRun *run = &runs[run_first];
+        run_first = (run_first + 1) % RECORD_RUNS;
+        run_count--;
+        record_retire(run);
+        if (!active) {
+            return;
+        }
+    }
+    bool final = !capturing;
+    while (run_count < RECORD_RUNS && record_issue(final)) {
+    }
+    if (final && active && run_count == 0 && head == tail) {
+        active = false;
+        stop_tick = HAL_GetTick();
+        // the take is only safe once it's out of the drive's write cache.
+        uint16_t err = checkpointDisk();
+        if (!punching) {
+            // then the header can have the stream's real mark back.
+            uint16_t close_err = tapeCloseTake(channel);
+            err = err ? err : close_err;
+        } else if (!err) {
+            err = record_keep_punch();
+        }
+        if (err) {
+            stats.error = err;
+            if (punching) {
+                patch_discard();
+            }
+        }
+        print("Record: %s done, %u sectors up to LBA %u\r\n", punching ? "punch-in" : "take", stats.sectors, issue_lba);
+    }
+}
+
+void record_set_run_sectors(uint32_t sectors) {
+    if (sectors < 1) {
+        sectors = 1;
+    }
+    run_sectors = sectors < RECORD_RUN_SECTORS ? sectors : RECORD_RUN_SECTORS;
+}
+
+uint32_t record_margin_ms() {
+    if (!active || !bytes_per_ms) {
+        return 0;
+    }
+    return (RECORD_RING_BYTES - (head - tail)) / bytes_per_ms;
+}
+
+uint32_t record_ring_ms() {
+    return bytes_per_ms ? RECORD_RING_BYTES / bytes_per_ms : 0;
+}
+
+const RecordStats *record_stats() {
+    stats.position = issue_lba;
+    uint32_t ms = (active ? HAL_GetTick() : stop_tick) - start_tick;
+    uint64_t bytes = (uint64_t)stats.sectors * 512;
+    stats.kbps = ms ? bytes / ms : 0;
+    stats.card_kbps = busy_us ? bytes * 1000 / busy_us : 0;
+    const VirtualTape *tape = getTape();
+    uint32_t channel_bytes_per_s = tape ? tape->sample_rate * tape->bit_depth : 0;
+    stats.max_channels = channel_bytes_per_s ? (uint64_t)stats.card_kbps * 1000 / channel_bytes_per_s : 0;
+    return &stats;
+}
+
+void record_print_stats() {
+    const RecordStats *s = record_stats();
+    print("Record: LBA %u, %u sectors, %u KB/s, card %u KB/s, up to %u channels\r\n",
+        s->position, s->sectors, s->kbps, s->card_kbps, s->max_channels);
+    print("Record: high water %u of %u bytes, %u overruns, %u frames dropped%s\r\n",
+        s->high_water, RECORD_RING_BYTES, s->overruns, s->dropped_frames, s->end_of_tape ? ", end of tape" : "");
+}
@@ -0,0 +1,222 @@
+#include "remap.h"
+
+#include "ata_driver.h"
+#include "block_cache.h"
+#include "print.h"
+
+#include <string.h>
+
+#define REMAP_MAGIC 0x50414d52 // "RMAP" in ascii
+#define REMAP_HASH_BITS 7      // twice the entries or more, so a probe rarely runs past the first slot
+#define REMAP_HASH_SIZE (1 << REMAP_HASH_BITS)
+#define REMAP_EMPTY 0xFF
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t lba;       // sector as the tape sees it
+    uint32_t spare_lba; // where it lives now
+} RemapEntry;
+
+typedef struct __attribute__((__packed__)) {
+    uint32_t magic_number;
+    uint16_t count;       // entries in use
+    uint16_t spares_used; // spares handed out, the ones that turned out bad themselves included
+    uint32_t spare_lba;
+    uint32_t spare_count;
+    RemapEntry entry[REMAP_MAX_ENTRIES];
+} RemapTable;
+
+_Static_assert(sizeof(RemapTable) == 512, "the remap table is one sector");
+_Static_assert(REMAP_HASH_SIZE >= 2 * REMAP_MAX_ENTRIES, "remap hash is too small");
+
+static RemapTable table;
+static uint32_t table_lba = 0;
+static bool loaded = false;
+// open addressed index into table.entry, by lba
+static uint8_t hash[REMAP_HASH_SIZE];
+
+static uint32_t remapped_reads = 0;
+static uint32_t bad_spares = 0;
+
+static unsigned remap_hash(uint32_t lba) {
+    // Fibonacci hashing, runs of neighbouring bad sectors land far apart.
+    return (lba * 2654435761u) >> (32 - REMAP_HASH_BITS);
+}
+
+static int remap_find(uint32_t lba) {
+    // nearly every card never needs a remap, don't make it pay for a probe.
+    if (!table.count) {
+        return -1;
+    }
+    // the table is never more than half full, so there is always an empty slot to stop at.
+    for (unsigned i = remap_hash(lba);; i = (i + 1) & (REMAP_HASH_SIZE - 1)) {
+        if (hash[i] == REMAP_EMPTY) {
+            return -1;
+        }
+        if (table.entry[hash[i]].lba == lba) {
+            return hash[i];
+        }
+    }
+}
+
+static void remap_insert(int e) {
+    unsigned i = remap_hash(table.entry[e].lba);
+    while (hash[i] != REMAP_EMPTY) {
+        i = (i + 1) & (REMAP_HASH_SIZE - 1);
+    }
+    hash[i] = e;
+}
+
+static void remap_reset(uint32_t lba, uint32_t spare_lba, uint32_t spare_count) {
+    memset(&table, 0, sizeof(table));
+    memset(hash, REMAP_EMPTY, sizeof(hash));
+    table.magic_number = REMAP_MAGIC;
+    table.spare_lba = spare_lba;
+    table.spare_count = spare_count;
+    table_lba = lba;
+    remapped_reads = 0;
+    bad_spares = 0;
+}
+
+static uint16_t remap_save() {
+    uint8_t *sector = block_cache_get_blank(table_lba);
+    if (!sector) {
+        // unknown error;
+        return 0xFFFF;
+    }
+    memcpy(sector, &table, sizeof(table));
+    block_cache_dirty(table_lba);
+    // a remap that isn't on the card yet would send the next mount back to the bad sector.
+    return block_cache_flush();
+}
+
+void remap_load(uint32_t lba, uint32_t spare_lba, uint32_t spare_count) {
+    remap_reset(lba, spare_lba, spare_count);
+    const RemapTable *stored = (const RemapTable *)block_cache_get(lba);
+    // a tape formatted before the table existed starts out empty, it gets written on the first remap.
+    if (stored && stored->magic_number == REMAP_MAGIC && stored->count <= REMAP_MAX_ENTRIES) {
+        memcpy(&table, stored, sizeof(table));
+        for (int e = 0; e < table.count; e++) {
+            remap_insert(e);
+        }
+    }
+    loaded = true;
+}
+
+uint16_t remap_format(uint32_t lba, uint32_t spare_lba, uint32_t spare_count) {
+    remap_reset(lba, spare_lba, spare_count);
+    loaded = true;
+    return remap_save();
+}
+
+void remap_unload() {
+    remap_reset(0, 0, 0);
+    loaded = false;
+}
+
+uint32_t remap_lookup(uint32_t lba) {
+    int e = remap_find(lba);
+    return e < 0 ? lba : table.entry[e].spare_lba;
+}
+
+// A remapped sector is always a run of one on its own, it has to be looked up.
+int remap_run(uint32_t lba, int count) {
+    if (!table.count) {
+        return count;
+    }
+    if (remap_find(lba) >= 0) {
+        return 1;
+    }
+    int n = 1;
+    while (n < count && remap_find(lba + n) < 0) {
+        n++;
+    }
+    return n;
+}
+
+uint16_t remap_sector(uint32_t lba, uint8_t *data) {
+    if (!loaded) {
+        return ATA_ERR_NO_MEDIA;
+    }
+    int e = remap_find(lba);
+    if (e < 0 && table.count == REMAP_MAX_ENTRIES) {
+        return REMAP_ERR_FULL;
+    }
+    while (table.spares_used < table.spare_count) {
+        uint32_t spare = table.spare_lba + table.spares_used;
+        uint16_t err = ata_write_disk(spare, data, 1);
+        if (err && !ATA_ERR_FROM_DRIVE(err)) {
+            // the card is in trouble rather than the spare, don't burn through them.
+            return err;
+        }
+        table.spares_used++;
+        if (err) {
+            // the spare is bad as well, it stays used up.
+            bad_spares++;
+            continue;
+        }
+        if (e < 0) {
+            e = table.count++;
+            table.entry[e].lba = lba;
+            remap_insert(e);
+        }
+        table.entry[e].spare_lba = spare;
+        print("Remap: LBA %u moved to spare LBA %u\r\n", lba, spare);
+        return remap_save();
+    }
+    return REMAP_ERR_FULL;
+}
+
+uint16_t remap_read(uint32_t lba, uint8_t *data, int count) {
+    while (count > 0) {
+        int n = remap_run(lba, count);
+        uint32_t actual = remap_lookup(lba);
+        if (actual != lba) {
+            remapped_reads++;
+        }
+        uint16_t err = ata_read_disk(actual, data, n);
+        if (err) {
+            return err;
+        }
+        lba += n;
+        data += n * 512;
+        count -= n;
+    }
+    return 0;
+}
+
+// Goes over a run that failed a sector at a time, the blocking calls don't say which sector it was.
+static uint16_t remap_write_sectors(uint32_t lba, uint8_t *data, int count) {
+    for (int i = 0; i < count; i++) {
+        uint16_t err = ata_write_disk(remap_lookup(lba + i), data + i * 512, 1);
+        if (ATA_ERR_FROM_DRIVE(err)) {
+            err = remap_sector(lba + i, data + i * 512);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    return 0;
+}
+
+uint16_t remap_write(uint32_t lba, uint8_t *data, int count) {
+    while (count > 0) {
+        int n = remap_run(lba, count);
+        // the driver has already retried, a media error that's still there won't go away.
+        uint16_t err = ata_write_disk(remap_lookup(lba), data, n);
+        if (ATA_ERR_FROM_DRIVE(err) && loaded) {
+            err = remap_write_sectors(lba, data, n);
+        }
+        if (err) {
+            return err;
+        }
+        lba += n;
+        data += n * 512;
+        count -= n;
+    }
+    return 0;
+}
+
+void remap_print_stats() {
+    print("Remap: %u sectors remapped, %u of %u spares used (%u bad), %u remapped reads\r\n",
+        table.count, table.spares_used, table.spare_count, bad_spares, remapped_reads);
+}
@@ -0,0 +1,128 @@
+#include "scrub.h"
+
+#include "ata_driver.h"
+#include "print.h"
+
+#include <string.h>
+
+#include "stm32f1xx_hal.h"
+
+static ScrubStatus status;
+static bool active = false;
+static bool in_flight = false;
+static uint32_t rest_until = 0;
+static uint8_t retries = 0;
+static AtaRequest req;
+static uint32_t region_lba[SCRUB_REGIONS];
+static uint32_t region_count[SCRUB_REGIONS];
+
+// Moves on to the first region from region on that has anything in it, false if none has.
+static bool scrub_enter(int region) {
+    for (; region < SCRUB_REGIONS; region++) {
+        if (region_count[region]) {
+            status.region = region;
+            status.start = region_lba[region];
+            status.count = region_count[region];
+            status.next = status.start;
+            return true;
+        }
+    }
+    return false;
+}
+
+void scrub_start(uint32_t lba, uint32_t count) {
+    memset(&status, 0, sizeof(status));
+    region_lba[SCRUB_REGION_TAPE] = lba;
+    region_count[SCRUB_REGION_TAPE] = count;
+    rest_until = HAL_GetTick();
+    retries = 0;
+    active = scrub_enter(0);
+}
+
+void scrub_region(int region, uint32_t lba, uint32_t count) {
+    if (region < 0 || region >= SCRUB_REGIONS) {
+        return;
+    }
+    region_lba[region] = lba;
+    region_count[region] = count;
+}
+
+void scrub_stop() {
+    // a chunk still in flight finishes on its own, its result is dropped.
+    active = false;
+}
+
+bool scrub_active() {
+    return active;
+}
+
+const ScrubStatus *scrub_status() {
+    return &status;
+}
+
+static void scrub_report(uint32_t lba) {
+    status.bad_total++;
+    for (int i = 0; i < status.bad_count; i++) {
+        if (status.bad[i] == lba) {
+            return;
+        }
+    }
+    if (status.bad_count < SCRUB_MAX_BAD) {
+        status.bad[status.bad_count++] = lba;
+    }
+    print("Scrub: bad sector at LBA %u\r\n", lba);
+}
+
+static void scrub_done(AtaRequest *r) {
+    in_flight = false;
+    if (!active) {
+        return;
+    }
+    uint32_t end = r->lba + r->count;
+    if (r->result == ATA_ERR_NO_MEDIA) {
+        active = false;
+        return;
+    }
+    if (ATA_ERR_FROM_DRIVE(r->result) && r->error_lba >= r->lba && r->error_lba < end) {
+        // carry on from just past the bad sector
+        scrub_report(r->error_lba);
+        end = r->error_lba + 1;
+    } else if (r->result) {
+        // not a media error, give the drive a moment and try the same chunk again, a few times.
+        if (++retries < SCRUB_MAX_RETRIES) {
+            rest_until = HAL_GetTick() + SCRUB_RETRY_MS;
+            return;
+        }
+        status.skipped++;
+        print("Scrub: gave up on LBA %u-%u, error %04x\r\n", r->lba, end - 1, r->result);
+    }
+    retries = 0;
+    status.next = end;
+    if (status.next >= status.start + status.count && !scrub_enter(status.region + 1)) {
+        status.passes++;
+        rest_until = HAL_GetTick() + SCRUB_PASS_INTERVAL_MS;
+        print("Scrub: pass %u done, %u bad sectors\r\n", status.passes, status.bad_total);
+        active = scrub_enter(0);
+    }
+}
+
+void scrub_service() {
+    if (!active || in_flight || (int32_t)(HAL_GetTick() - rest_until) < 0) {
+        return;
+    }
+    // only ever use idle time, anything else in the queue goes first.
+    if (ata_busy() || ata_queue_stats()->depth) {
+        return;
+    }
+    uint32_t left = status.start + status.count - status.next;
+    req.op = ATA_OP_VERIFY;
+    req.lba = status.next;
+    req.count = left < SCRUB_CHUNK_SECTORS ? left : SCRUB_CHUNK_SECTORS;
+    req.data = NULL;
+    req.done = scrub_done;
+    req.ctx = NULL;
+    req.deadline = HAL_GetTick() + SCRUB_PASS_INTERVAL_MS;
+    if (ata_queue(&req) == 0) {
+        in_flight = true;
+    }
+}
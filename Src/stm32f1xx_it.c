@@ -23,6 +23,7 @@
 #include "stm32f1xx_it.h"
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
+#include "ide_controller.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -58,6 +59,8 @@
 /* External variables --------------------------------------------------------*/
 
 /* USER CODE BEGIN EV */
+extern DMA_HandleTypeDef hdma_ide_data;
+extern DMA_HandleTypeDef hdma_ide_strobe_hi;
 
 /* USER CODE END EV */
 
@@ -198,6 +201,29 @@ void SysTick_Handler(void)
 /******************************************************************************/
 
 /* USER CODE BEGIN 1 */
+/**
+  * @brief This function handles DMA1 channel2 global interrupt, IDE data transfers.
+  */
+void DMA1_Channel2_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_ide_data);
+}
+
+/**
+  * @brief This function handles DMA1 channel6 global interrupt, IDE write strobe.
+  */
+void DMA1_Channel6_IRQHandler(void)
+{
+  HAL_DMA_IRQHandler(&hdma_ide_strobe_hi);
+}
+
+/**
+  * @brief This function handles EXTI line[9:5] interrupts, IDE INTRQ.
+  */
+void EXTI9_5_IRQHandler(void)
+{
+  HAL_GPIO_EXTI_IRQHandler(0x01 << IDE_INTRQ_PIN);
+}
 
 /* USER CODE END 1 */
 /************************ (C) COPYRIGHT STMicroelectronics *****END OF FILE****/
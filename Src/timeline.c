@@ -0,0 +1,34 @@
+#include "timeline.h"
+
+#include "print.h"
+#include "stopwatch.h"
+
+#include "stm32f1xx_hal.h"
+
+typedef struct {
+    const char *phase;
+    uint32_t tick_ms;  // HAL tick, counts from reset
+    uint32_t cycles;   // DWT cycle counter, finer but only running once IDE_init has started it
+} TimelineMark;
+
+static TimelineMark marks[TIMELINE_MAX_MARKS];
+static uint8_t mark_count = 0;
+
+void timeline_mark(const char *phase) {
+    if (mark_count == TIMELINE_MAX_MARKS) {
+        return;
+    }
+    marks[mark_count].phase = phase;
+    marks[mark_count].tick_ms = HAL_GetTick();
+    marks[mark_count].cycles = STOPWATCH_GET_TICKS();
+    mark_count++;
+}
+
+void timeline_print() {
+    print("Boot timeline:\r\n");
+    for (int i = 0; i < mark_count; i++) {
+        // the phase length is measured in cycles, each phase has to be short enough not to wrap the counter.
+        uint32_t us = i ? (marks[i].cycles - marks[i - 1].cycles) / (CLK_SPEED / 1000000) : 0;
+        print("  %6u ms  +%8u us  %s\r\n", marks[i].tick_ms, us, marks[i].phase);
+    }
+}
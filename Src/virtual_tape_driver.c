@@ -1,11 +1,33 @@
+#include "virtual_tape_driver.h"
+
 #include "ata_driver.h"
+#include "block_cache.h"
+#include "print.h"
+#include "patch.h"
+#include "record.h"
+#include "remap.h"
+#include "scrub.h"
+#include "timeline.h"
 
 #include <string.h> //using for memset.
 #include <stdbool.h>
 
+#include "stm32f1xx_hal.h"
+
 #define HEADER_MAGIC_NUM 0x494445415544494f // "IDEAUDIO" in ascii, its 8 bytes so is a uint64_t
 #define TAPE_PARTITION_TYPE 0x23 // originally windows mobile boot, but I think its safe to reuse.
-#define TAPE_NAME_LEN 64
+#define PRE_ERASE_PROBE_SECTORS 256 // written to time the card, before and after the pre-erase
+#define LBA28_LIMIT 0x10000000      // CFA erase commands can't reach past LBA28
+#define MBR_SIGNATURE 0xAA55
+#define FORMAT_HEADER_LBA 1         // where formatDisk puts the header, the tape partition starts there
+// the reserved area in front of the tape, in sectors on from the header
+#define RESERVED_REMAP_TABLE 1
+#define RESERVED_PATCH_TABLE 2
+#define RESERVED_CAL_SCRATCH 3      // for ATA bus timing calibration to write its patterns to
+#define RESERVED_PATCH_POOL 4       // punch-ins, from here up to the remap spares
+#define HEADER_MAJOR_VER 0
+#define HEADER_MINOR_VER 2 // 1 added the layout, 2 the erased marks
+#define TAPE_NOT_ERASED 0xFFFFFFFF  // erased mark of a stream with nothing left erased
 
 
 typedef struct __attribute__((__packed__)) {
@@ -40,7 +62,13 @@ typedef struct __attribute__((__packed__)) {
                              // (convert back to lbas by multiplying by stride)
     uint32_t sample_rate;    // sample rate of tape
     char name [TAPE_NAME_LEN]; // Name of this disk
-    // current size 84 bytes
+    // minor version 1
+    uint8_t layout;          // TAPE_LAYOUT_INTERLEAVED or TAPE_LAYOUT_PLANAR, interleaved before version 1
+    uint8_t reserved;
+    uint16_t chunk_sectors;  // planar: sectors of one channel in a row, before the next channel's chunk
+    // minor version 2
+    uint32_t erased_from[TAPE_MAX_STREAMS]; // per stream, the sector it's pre-erased from on, or TAPE_NOT_ERASED
+    // current size 220 bytes
     // newer versions of this header will grow down.
     // the maximum size of this header is 512 bytes, or one block.
 } Header;
@@ -53,33 +81,18 @@ typedef struct {
 } LbaPartition;
 
 
-typedef struct {
-    // AtaController *ata_drive;
-    bool disk_valid;                // is this disk formatted correctly
-    unsigned int header_offset_lba; // start of partition, in LBAs.
-    unsigned int tape_offset_lba;   // start of the linear data, in LBAs
-    unsigned char header_ver[2];    // data version of this disk [0] major, [1] minor
-    unsigned int n_channels;        // number of channels on this disk
-    unsigned int bit_depth;         // number of bytes per sample
-    unsigned int stride;            // offset between blocks, of a channel (=n_channels * bit_depth)
-    char disk_name[TAPE_NAME_LEN];    // Label on this disk
-} VirtualTape;
-
-// This is a sratch buffer for storing temporary data retrived from disk.
-// Its contents nor any pointers from within it are to be passed outside of
-// the boundry of a function. This is treated like a super local variable.
-// Every time a function call or return is made the contents of this variable are
-// to be considered invalid. That is because this variable is used by all header 
-// manipulation functions to store data about to be read/writen from/to disk
-// this will save a LOT of stack space, as every function that needs to access the disk
-// would otherwise need a 512 byte local variable, these add up quickly.
-uint8_t scratch[512] = {0};
+// Header sectors are accessed through the block cache, rather than a scratch buffer.
+// Pointers it hands out are treated like a super local variable, they are not to be
+// passed outside of the boundry of a function, and every time a function call or return
+// is made they are to be considered invalid, as any other cache call may evict the sector.
 
 VirtualTape tape = {0};
 
+// per stream, the sector from which on it's still erased since formatDisk, or TAPE_NOT_ERASED.
+static uint32_t erased_from[TAPE_MAX_STREAMS];
+// streams with a take open on them, one bit each.
+static uint32_t open_streams = 0;
 
-void onDriveAttach(uint32_t disk_len_lba, void *ctx);
-void onDriveDetach(void *ctx);
 
 void readMbr(LbaPartition[4]);
 
@@ -89,16 +102,48 @@ void initDisk() {
     readMbr(partition);
     for (int i = 0; i<4; i++) {
         if (partition[i].type == TAPE_PARTITION_TYPE) {
-            ata_read_disk(partition[i].start_lba, scratch, 1);
-            Header *header = (Header*)scratch;
-	    if (header->magic_number == HEADER_MAGIC_NUM) {
+            Header *header = (Header*)block_cache_get(partition[i].start_lba);
+	    if (header && header->magic_number == HEADER_MAGIC_NUM) {
                 tape.header_offset_lba = partition[i].start_lba;
 		tape.tape_offset_lba = tape.header_offset_lba + header->tape_start;
 		tape.disk_valid = true;
 		tape.n_channels = header->channel_count;
 		tape.bit_depth = header->word_len;
 		tape.stride = tape.n_channels * tape.bit_depth;
+		tape.tape_len_lba = header->tape_len * tape.stride;
+		tape.sample_rate = header->sample_rate;
+		tape.header_ver[0] = header->major_ver;
+		tape.header_ver[1] = header->minor_ver;
+		tape.layout = TAPE_LAYOUT_INTERLEAVED;
+		tape.chunk_sectors = 0;
+		if (header->minor_ver >= 1) {
+		    tape.layout = header->layout;
+		    tape.chunk_sectors = header->chunk_sectors;
+		}
+		bool planar = tape.layout == TAPE_LAYOUT_PLANAR && tape.chunk_sectors && tape.n_channels;
+		if (header->major_ver != HEADER_MAJOR_VER || (tape.layout != TAPE_LAYOUT_INTERLEAVED && !planar)) {
+		    print("Tape: header version %u.%u, layout %u not supported\r\n", header->major_ver, header->minor_ver, tape.layout);
+		    memset(&tape, 0, sizeof(tape));
+		    return;
+		}
+		if (planar) {
+		    // only whole chunks, every channel has the same length.
+		    uint32_t chunk_row = tape.n_channels * tape.chunk_sectors;
+		    tape.tape_len_lba -= tape.tape_len_lba % chunk_row;
+		}
+		for (int s = 0; s < TAPE_MAX_STREAMS; s++) {
+		    // older tapes don't say, so nothing on them counts as erased.
+		    erased_from[s] = header->minor_ver >= 2 ? header->erased_from[s] : TAPE_NOT_ERASED;
+		}
+		open_streams = 0;
 		strncpy(tape.disk_name, header->name, TAPE_NAME_LEN);
+		// the remap spares sit right in front of the tape.
+		uint32_t spare_lba = tape.tape_offset_lba - REMAP_SPARE_SECTORS;
+		remap_load(tape.header_offset_lba + RESERVED_REMAP_TABLE, spare_lba, REMAP_SPARE_SECTORS);
+		uint32_t pool_lba = tape.header_offset_lba + RESERVED_PATCH_POOL;
+		patch_load(tape.header_offset_lba + RESERVED_PATCH_TABLE, pool_lba, spare_lba - pool_lba);
+		// the one sector on the card calibration is allowed to write.
+		ata_set_scratch_sector(tape.header_offset_lba + RESERVED_CAL_SCRATCH);
 		return;
             }
 	}
@@ -108,8 +153,11 @@ void initDisk() {
 
 void readMbr(LbaPartition* partitions) {
     //LbaPartition partitions[4];
-    ata_read_disk(0, scratch, 1);
-    Mbr *mbr = (Mbr*)scratch;
+    Mbr *mbr = (Mbr*)block_cache_get(0);
+    if (!mbr) {
+        memset(partitions, 0, sizeof(LbaPartition) * 4);
+        return;
+    }
     for (int i = 0; i<4; i++) {
         partitions[i].start_lba = mbr->partition[i].start_lba_sector;
         partitions[i].lba_count = mbr->partition[i].lba_sector_count;
@@ -117,30 +165,322 @@ void readMbr(LbaPartition* partitions) {
     }
 }
 
-void formatDisk(uint32_t disk_len, uint8_t n_channels, uint32_t rate) {
+// Times writes to the start of a region in runs as long as a take's, in KB/s, what recording would get.
+static uint32_t measureWriteSpeed(uint32_t lba, uint8_t *data, uint32_t count, bool erased) {
+    uint32_t start = HAL_GetTick();
+    for (uint32_t i = 0; i < count; i += RECORD_RUN_SECTORS) {
+        int n = count - i < RECORD_RUN_SECTORS ? count - i : RECORD_RUN_SECTORS;
+        uint16_t err = erased ? ata_write_erased(lba + i, data, n) : ata_write_disk(lba + i, data, n);
+        if (err) {
+            return 0;
+        }
+    }
+    uint32_t ms = HAL_GetTick() - start;
+    return ms ? (count * 512) / ms : 0;
+}
+
+/**
+ * Erases the tape area up front on CF cards, so recording can write without an erase cycle.
+ * The write speed is measured before and after, to see what it bought us.
+ * Returns true only if all of it is erased, a tape running on past LBA28 is only erased in part.
+ */
+static bool preEraseTape(uint32_t lba, uint32_t count) {
+    const AtaCapabilities *caps = ata_capabilities();
+    if (!caps || !caps->cfa) {
+        print("Pre-erase: not a CF card, skipped\r\n");
+        return false;
+    }
+    bool whole = true;
+    if (lba + count > LBA28_LIMIT) {
+        count = lba < LBA28_LIMIT ? LBA28_LIMIT - lba : 0;
+        whole = false;
+    }
+    uint32_t probe_len = count < PRE_ERASE_PROBE_SECTORS ? count : PRE_ERASE_PROBE_SECTORS;
+    // nothing is recording while we format, so a run of the header sector goes in the record ring.
+    uint8_t *probe = record_borrow_ring();
+    uint8_t *header = block_cache_get(FORMAT_HEADER_LBA);
+    if (!probe || !header || !probe_len) {
+        return false;
+    }
+    for (int s = 0; s < RECORD_RUN_SECTORS; s++) {
+        memcpy(probe + s * 512, header, 512);
+    }
+    uint32_t before = measureWriteSpeed(lba, probe, probe_len, false);
+    uint16_t err = ata_erase_disk(lba, count);
+    if (err) {
+        print("Pre-erase failed: 0x%04x\r\n", err);
+        return false;
+    }
+    uint32_t after = measureWriteSpeed(lba, probe, probe_len, true);
+    // the probe wrote over the start of the erased area, put it back.
+    err = ata_erase_disk(lba, probe_len);
+    if (err) {
+        print("Pre-erase failed: 0x%04x\r\n", err);
+        return false;
+    }
+    print("Pre-erase: %u sectors, writes %u KB/s before, %u KB/s after\r\n", count, before, after);
+    return whole;
+}
+
+uint16_t formatDisk(uint32_t disk_len, uint8_t n_channels, uint32_t rate, uint16_t chunk_sectors, bool pre_erase) {
     // write mbr
-    memset(scratch, 0, sizeof(scratch));
-    Mbr *mbr = (Mbr*)scratch;
+    Mbr *mbr = (Mbr*)block_cache_get_blank(0);
+    if (!mbr) {
+        // unknown error;
+        return 0xFFFF;
+    }
     // todo figure out how to correctly ignore CHS adressing.
     // mbr->partition[0].start_sector = 1;
-    mbr->partition[0].start_lba_sector = 1;
-    mbr->partition[0].lba_sector_count = disk_len - 1;
-    ata_write_disk(0, scratch, 1);
+    // initDisk finds the tape by its partition type.
+    mbr->partition[0].type = TAPE_PARTITION_TYPE;
+    mbr->boot_signature = MBR_SIGNATURE;
+    mbr->partition[0].start_lba_sector = FORMAT_HEADER_LBA;
+    mbr->partition[0].lba_sector_count = disk_len - FORMAT_HEADER_LBA;
+    block_cache_dirty(0);
     // write header
-    memset(scratch, 0, sizeof(scratch));
-    uint32_t len = disk_len - 1024; // this is the preallocated space for the ToC and any patches.
+    // this is the preallocated space in front of the tape: MBR, header, remap table, patch table,
+    // the calibration scratch sector, then patches and the remap spares.
+    uint32_t len = disk_len - 1024;
     uint8_t stride = n_channels * 2;
     uint32_t tape_len = len / stride;
-    Header *header = (Header*)scratch;
+    if (chunk_sectors) {
+        // planar tapes end on a whole chunk of every channel, a stride holds 2 sectors of each.
+        uint32_t strides_per_chunk = (chunk_sectors % 2) ? chunk_sectors : chunk_sectors / 2;
+        tape_len -= tape_len % strides_per_chunk;
+    }
+    Header *header = (Header*)block_cache_get_blank(FORMAT_HEADER_LBA);
+    if (!header) {
+        // unknown error;
+        return 0xFFFF;
+    }
     header->magic_number = HEADER_MAGIC_NUM;
-    header->major_ver = 0;
-    header->minor_ver = 0;
+    header->major_ver = HEADER_MAJOR_VER;
+    header->minor_ver = HEADER_MINOR_VER;
     header->channel_count = n_channels;
     header->word_len = 2;
     header->tape_start = 1023;
     header->tape_len = tape_len;
     header->sample_rate = rate;
     strncpy(header->name, "Untitiled Disk", TAPE_NAME_LEN);
-    ata_write_disk(1, scratch, 1);
+    header->layout = chunk_sectors ? TAPE_LAYOUT_PLANAR : TAPE_LAYOUT_INTERLEAVED;
+    header->chunk_sectors = chunk_sectors;
+    // nothing is erased until preEraseTape says so.
+    for (int s = 0; s < TAPE_MAX_STREAMS; s++) {
+        header->erased_from[s] = TAPE_NOT_ERASED;
+    }
+    uint32_t tape_lba = FORMAT_HEADER_LBA + header->tape_start;
+    block_cache_dirty(FORMAT_HEADER_LBA);
+    // same layout initDisk expects, an old table would send reads of the new tape off to stale spares.
+    uint32_t spare_lba = tape_lba - REMAP_SPARE_SECTORS;
+    uint16_t err = remap_format(FORMAT_HEADER_LBA + RESERVED_REMAP_TABLE, spare_lba, REMAP_SPARE_SECTORS);
+    // and old patches would cover it with takes from the last one.
+    if (!err) {
+        uint32_t pool_lba = FORMAT_HEADER_LBA + RESERVED_PATCH_POOL;
+        err = patch_format(FORMAT_HEADER_LBA + RESERVED_PATCH_TABLE, pool_lba, spare_lba - pool_lba);
+    }
+    // a fresh format has to be on the card before anything is recorded onto it.
+    if (!err) {
+        err = checkpointDisk();
+    }
+    if (err) {
+        print("Format failed: 0x%04x\r\n", err);
+        return err;
+    }
+    if (pre_erase && preEraseTape(tape_lba, tape_len * stride)) {
+        // only once the erase is done, a mark on the card always has erased media behind it.
+        header = (Header*)block_cache_get(FORMAT_HEADER_LBA);
+        if (header) {
+            for (int s = 0; s < TAPE_MAX_STREAMS; s++) {
+                header->erased_from[s] = 0;
+            }
+            block_cache_dirty(FORMAT_HEADER_LBA);
+            err = checkpointDisk();
+        }
+    }
+    // mount the fresh tape, whatever was mounted before is gone.
+    initDisk();
+    return err;
+}
+
+uint16_t checkpointDisk() {
+    // audio still in the ATA queue has to reach the drive first, block_cache_flush only waits
+    // for what is already on the bus. Then its FLUSH CACHE pushes all of it out to the media.
+    while (ata_busy() || ata_queue_stats()->depth) {
+        ata_service();
+    }
+    return block_cache_flush();
+}
+
+const VirtualTape *getTape() {
+    return tape.disk_valid ? &tape : NULL;
 }
 
+uint32_t tapeFrameBytes(int channel) {
+    if (!tape.disk_valid) {
+        return 0;
+    }
+    if (tape.layout == TAPE_LAYOUT_PLANAR) {
+        return (channel >= 0 && (unsigned int)channel < tape.n_channels) ? tape.bit_depth : 0;
+    }
+    return channel == TAPE_ALL_CHANNELS ? tape.stride : 0;
+}
+
+uint32_t tapeStreamSectors(int channel) {
+    if (!tapeFrameBytes(channel)) {
+        return 0;
+    }
+    return tape.layout == TAPE_LAYOUT_PLANAR ? tape.tape_len_lba / tape.n_channels : tape.tape_len_lba;
+}
+
+uint32_t tapeStreamLba(int channel, uint32_t sector, uint32_t *run) {
+    if (tape.layout != TAPE_LAYOUT_PLANAR) {
+        *run = tape.tape_len_lba - sector;
+        return sector;
+    }
+    uint32_t chunk = sector / tape.chunk_sectors;
+    uint32_t within = sector % tape.chunk_sectors;
+    *run = tape.chunk_sectors - within;
+    return (chunk * tape.n_channels + channel) * tape.chunk_sectors + within;
+}
+
+// Stream a tape LBA belongs to and its sector in it, run gets how many sectors on stay in that stream.
+static int tapeLbaStream(uint32_t lba, uint32_t *sector, uint32_t *run) {
+    if (tape.layout != TAPE_LAYOUT_PLANAR) {
+        *sector = lba;
+        *run = tape.tape_len_lba - lba;
+        return TAPE_ALL_CHANNELS;
+    }
+    uint32_t chunk = lba / tape.chunk_sectors;
+    uint32_t within = lba % tape.chunk_sectors;
+    *run = tape.chunk_sectors - within;
+    *sector = (chunk / tape.n_channels) * tape.chunk_sectors + within;
+    return chunk % tape.n_channels;
+}
+
+// Index of a stream's erased mark, -1 for the streams past TAPE_MAX_STREAMS, they never count as erased.
+static int tapeStreamIndex(int channel) {
+    int i = channel == TAPE_ALL_CHANNELS ? 0 : channel;
+    return (i >= 0 && i < TAPE_MAX_STREAMS) ? i : -1;
+}
+
+/**
+ * Puts the erased marks into the header and makes it durable. A stream with a take open is stored
+ * as not erased, so a take cut short by a power loss can't leave its sectors looking erased.
+ */
+static uint16_t saveErasedMarks() {
+    Header *header = (Header*)block_cache_get(tape.header_offset_lba);
+    if (!header) {
+        // unknown error;
+        return 0xFFFF;
+    }
+    for (int s = 0; s < TAPE_MAX_STREAMS; s++) {
+        header->erased_from[s] = (open_streams & (1u << s)) ? TAPE_NOT_ERASED : erased_from[s];
+    }
+    // an older tape picks up the marks with this.
+    header->minor_ver = HEADER_MINOR_VER;
+    block_cache_dirty(tape.header_offset_lba);
+    return block_cache_flush();
+}
+
+bool tapeErased(int channel, uint32_t sector) {
+    int i = tapeStreamIndex(channel);
+    return tape.disk_valid && i >= 0 && erased_from[i] != TAPE_NOT_ERASED && sector >= erased_from[i];
+}
+
+uint16_t tapeOpenTake(int channel) {
+    int i = tapeStreamIndex(channel);
+    if (i < 0 || (open_streams & (1u << i))) {
+        return 0;
+    }
+    open_streams |= 1u << i;
+    // a stream with nothing erased left has nothing to protect.
+    return erased_from[i] == TAPE_NOT_ERASED ? 0 : saveErasedMarks();
+}
+
+uint16_t tapeWritten(int channel, uint32_t sector, uint32_t count) {
+    int i = tapeStreamIndex(channel);
+    if (i < 0 || erased_from[i] == TAPE_NOT_ERASED || sector + count <= erased_from[i]) {
+        return 0;
+    }
+    erased_from[i] = sector + count;
+    // an open take's mark is already stored as not erased.
+    return (open_streams & (1u << i)) ? 0 : saveErasedMarks();
+}
+
+uint16_t tapeCloseTake(int channel) {
+    int i = tapeStreamIndex(channel);
+    if (i < 0 || !(open_streams & (1u << i))) {
+        return 0;
+    }
+    open_streams &= ~(1u << i);
+    return erased_from[i] == TAPE_NOT_ERASED ? 0 : saveErasedMarks();
+}
+
+uint32_t tapeResolve(uint32_t lba, uint32_t *run, bool *patched) {
+    uint32_t patch_lba;
+    *patched = patch_lookup(lba, run, &patch_lba);
+    return *patched ? patch_lba : tape.tape_offset_lba + lba;
+}
+
+static bool inTape(uint32_t lba, int count) {
+    return tape.disk_valid && count >= 0 && lba < tape.tape_len_lba && count <= tape.tape_len_lba - lba;
+}
+
+// Goes over the tape a run at a time, each run either all patched or all on the tape itself.
+static uint16_t accessTape(uint32_t lba, uint8_t *data, int count, bool write) {
+    if (!inTape(lba, count)) {
+        return ATA_ERR_RANGE;
+    }
+    while (count > 0) {
+        uint32_t run;
+        bool patched;
+        uint32_t actual = tapeResolve(lba, &run, &patched);
+        uint32_t n = (uint32_t)count < run ? (uint32_t)count : run;
+        uint16_t err = 0;
+        if (write && !patched) {
+            // the mark has to be past the sectors before they are written, not after.
+            uint32_t sector;
+            uint32_t stream_run;
+            int channel = tapeLbaStream(lba, &sector, &stream_run);
+            n = n < stream_run ? n : stream_run;
+            err = tapeWritten(channel, sector, n);
+        }
+        if (!err) {
+            err = write ? remap_write(actual, data, n) : remap_read(actual, data, n);
+        }
+        if (err) {
+            return err;
+        }
+        lba += n;
+        data += n * 512;
+        count -= n;
+    }
+    return 0;
+}
+
+uint16_t readTape(uint32_t lba, uint8_t *data, int count) {
+    return accessTape(lba, data, count, false);
+}
+
+uint16_t writeTape(uint32_t lba, uint8_t *data, int count) {
+    return accessTape(lba, data, count, true);
+}
+
+void onDriveAttach(uint32_t disk_len_lba, void *ctx) {
+    initDisk();
+    timeline_mark("tape mounted");
+    if (tape.disk_valid) {
+        // keep an eye on the recorded audio whenever the card has nothing better to do.
+        scrub_start(tape.tape_offset_lba, tape.tape_len_lba);
+    }
+}
+
+void onDriveDetach(void *ctx) {
+    // whatever was cached belongs to the card that just left.
+    scrub_stop();
+    remap_unload();
+    patch_unload();
+    block_cache_invalidate();
+    memset(&tape, 0, sizeof(tape));
+    open_streams = 0;
+}